@@ -22,20 +22,27 @@
  * SOFTWARE.
  */
 
+#include <linux/bitmap.h>
 #include <linux/clk.h>
 #include <linux/clk-provider.h>
 #include <linux/clkdev.h>
 #include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/gpio/consumer.h>
 #include <linux/i2c.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/of_device.h>
 #include <linux/regulator/consumer.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <media/v4l2-async.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
@@ -92,9 +99,82 @@
 #define GC2145_XCLK_MAX     48000000
 #define GC2145_PIXEL_RATE   (120 * 1000 * 1000)
 
+/*
+ * Power sequencing intervals, datasheet minimums.
+ * Every wait sleeps with GC2145_T_SLACK_US of slack instead of spinning.
+ */
+#define GC2145_T_RAIL_US        50   /* between two supply rails */
+#define GC2145_T_XCLK_US        100  /* xclk stable before PWDN release */
+#define GC2145_T_PWDN_US        100  /* PWDN low before RESETB release */
+#define GC2145_T_RESET_CYCLES   8192 /* xclk cycles from RESETB to first SCCB */
+#define GC2145_T_SLACK_US       20
+
+#define GC2145_PWR_STEPS_MAX    12
+
+#define GC2145_PAGE_INVALID     0xFF
+#define GC2145_PAGES            4
+#define GC2145_REG_GLOBAL       0xF0 /* 0xf0-0xff are visible from every page */
+#define GC2145_BURST_MAX        64 /* registers per burst write */
+#define GC2145_QUEUE_MSGS       16 /* messages per queue flush transfer */
+#define GC2145_QUEUE_BYTES      256
+#define GC2145_I2C_RETRIES      2 /* extra attempts per transfer */
+#define GC2145_LAT_BUCKETS      24 /* log2 us, the last one is open ended */
+
+/* 3A convergence polling */
+#define GC2145_3A_IDLE_POLL_MS  200 /* once converged */
+#define GC2145_AE_MARGIN        8   /* luma distance to target */
+#define GC2145_AWB_MARGIN       2   /* gain change between two polls */
+#define GC2145_3A_STABLE_POLLS  2
+
+/* Driver specific controls */
+#define GC2145_CID_CUSTOM_BASE          (V4L2_CID_USER_BASE | 0xf000)
+#define V4L2_CID_GC2145_3A_CONVERGED    (GC2145_CID_CUSTOM_BASE + 0)
+#define V4L2_CID_GC2145_MIN_FPS         (GC2145_CID_CUSTOM_BASE + 1)
+#define V4L2_CID_GC2145_GAMMA           (GC2145_CID_CUSTOM_BASE + 2)
+#define V4L2_CID_GC2145_GAMMA_CURVE     (GC2145_CID_CUSTOM_BASE + 3)
+#define V4L2_CID_GC2145_DENOISE         (GC2145_CID_CUSTOM_BASE + 4)
+#define V4L2_CID_GC2145_3A_STATS        (GC2145_CID_CUSTOM_BASE + 5)
+#define V4L2_CID_GC2145_BRACKET         (GC2145_CID_CUSTOM_BASE + 6)
+#define V4L2_CID_GC2145_BRACKET_MODE    (GC2145_CID_CUSTOM_BASE + 7)
+
+/*
+ * V4L2_CID_GC2145_BRACKET entries: exposure rows in bits 0-15, analog
+ * gain in bits 16-23 and digital gain in bits 24-31. A zero entry ends
+ * the sequence.
+ */
+#define GC2145_BRACKET_MAX              8
+#define GC2145_BRACKET_EXPOSURE(e)      ((e) & 0xffff)
+#define GC2145_BRACKET_GAIN(e)          (((e) >> 16) & 0xff)
+#define GC2145_BRACKET_DIGITAL_GAIN(e)  (((e) >> 24) & 0xff)
+#define GC2145_BRACKET_NONE             0xff /* gc2145_frame_meta.bracket */
+
+/* V4L2_CID_GC2145_3A_STATS elements */
+enum {
+    GC2145_STAT_Y_AVG,
+    GC2145_STAT_AEC_TARGET,
+    GC2145_STAT_EXPOSURE,
+    GC2145_STAT_PREGAIN,
+    GC2145_STAT_POSTGAIN,
+    GC2145_STAT_WB_R,
+    GC2145_STAT_WB_G,
+    GC2145_STAT_WB_B,
+    GC2145_STAT_NUM,
+};
+
+/*
+ * Private event carrying the sensor state of each frame, struct
+ * gc2145_frame_meta in v4l2_event.u.data
+ */
+#define V4L2_EVENT_GC2145_FRAME_META    (V4L2_EVENT_PRIVATE_START + 1)
+#define GC2145_META_EVENTS              4 /* queued per subscriber */
+
+#define GC2145_3A_AE_CONVERGED  BIT(0)
+#define GC2145_3A_AWB_CONVERGED BIT(1)
+
 /* Page 0 */
 enum {
     GC2145_REG_OUTPUT_FORMAT = 0x84,
+    GC2145_REG_BYPASS_MODE = 0x89,
     GC2145_REG_CHIP_ID_H = 0xF0,
     GC2145_REG_CHIP_ID_L = 0xF1,
     GC2145_REG_PAD_MODE = 0xF2,
@@ -102,12 +182,111 @@ enum {
     GC2145_REG_NULL = 0xFF, /* Array end token */
 };
 
+/* Page 0 */
+enum {
+    GC2145_P0_EXPOSURE_H = 0x03,
+    GC2145_P0_EXPOSURE_L = 0x04,
+    GC2145_P0_ORIENTATION = 0x17,
+    GC2145_P0_CLK_MODE = 0x20, /* follows P0 0xfa, see gc2145_setting_uxga */
+    GC2145_P0_AAA_CTRL = 0x82,
+    GC2145_P0_DEBUG_MODE2 = 0x8C,
+    GC2145_P0_CROP_Y_H = 0x91, /* y, x, height, width, subsample */
+    GC2145_P0_SUBSAMPLE = 0x99,
+    GC2145_P0_SUB_MODE = 0x9A,
+    GC2145_P0_SUB_H_POS = 0x9B, /* 4 regs each for columns then rows */
+    GC2145_P0_CLK_DIV = 0xFA,
+    GC2145_P0_SCALER = 0xFD,
+    GC2145_P0_PREGAIN = 0xB1,
+    GC2145_P0_POSTGAIN = 0xB2,
+    GC2145_P0_AWB_R_GAIN = 0xB3,
+    GC2145_P0_AEC_MODE = 0xB6,
+    GC2145_P0_AWB_G_GAIN = 0xB4,
+    GC2145_P0_AWB_B_GAIN = 0xB5,
+};
+
+/* Page 1 */
+enum {
+    GC2145_P1_ANTIFLICKER_STEP_H = 0x25, /* step, then 4 exposure levels */
+    GC2145_P1_AEC_TARGET = 0x13,
+    GC2145_P1_AEC_Y_AVG = 0x14,
+    GC2145_P1_CLK_MODE = 0x21, /* follows P0 0xfa */
+};
+
+/* Page 2 */
+enum {
+    GC2145_P2_GAMMA1 = 0x10, /* gamma1 then gamma2, 22 points each */
+    GC2145_P2_DN_B_BASE = 0x82,
+    GC2145_P2_DN_B_SLOPE = 0x83,
+    GC2145_P2_EDGE_EFFECT = 0x97, /* [7:4] edge1, [3:0] edge2 */
+
+    GC2145_P2_SATURATION_CB = 0xD1,
+    GC2145_P2_SATURATION_CR = 0xD2,
+    GC2145_P2_CONTRAST = 0xD3,
+    GC2145_P2_LUMA_OFFSET = 0xD5,
+};
+
+#define GC2145_GAMMA_POINTS         22
+#define GC2145_SHARPNESS_DEFAULT    6    /* P2 0x97 = 0x65 in gc2145_init_regs */
+#define GC2145_DENOISE_MAX          0x1f
+#define GC2145_DENOISE_DEFAULT      5    /* P2 0x82/0x83 = 0x05/0x08 */
+#define GC2145_SATURATION_DEFAULT   0x32
+#define GC2145_CONTRAST_DEFAULT     0x40
+
+#define GC2145_BYPASS_MODE_SWITCH  BIT(5) /* P0 0x89, swaps the two output bytes */
+
+#define GC2145_MIRROR       BIT(0)
+#define GC2145_FLIP         BIT(1)
+/* P0 0x17 as in gc2145_init_regs, the flip controls are relative to it */
+#define GC2145_ORIENT_MOUNT (GC2145_MIRROR | GC2145_FLIP)
+
+/* P0 0xfa with its P0 0x20 and P1 0x21 companions, full and halved PCLK */
+#define GC2145_CLK_DIV_FULL         0x00
+#define GC2145_CLK_DIV_HALF         0x11
+#define GC2145_CLK_MODE_FULL_P0     0x03
+#define GC2145_CLK_MODE_FULL_P1     0x04
+#define GC2145_CLK_MODE_HALF        0x15
+#define GC2145_CLK_DIV_UNSCALED     2 /* YUV with the 1/2 scaler off, as UXGA */
+
+#define GC2145_AEC_ENABLE   BIT(0)
+#define GC2145_AAA_CTRL_BASE 0xF8 /* P0 0x82 as in gc2145_init_regs, AWB off */
+#define GC2145_AWB_ENABLE   BIT(1)
+
+/* P0 0x8c */
+#define GC2145_TEST_PATTERN_ENABLE  BIT(0)
+#define GC2145_TEST_UNIFORM         BIT(3)
+#define GC2145_TEST_WHITE           (0x04 << 4)
+#define GC2145_TEST_YELLOW          (0x08 << 4)
+#define GC2145_TEST_CYAN            (0x09 << 4)
+#define GC2145_TEST_GREEN           (0x06 << 4)
+#define GC2145_TEST_MAGENTA         (0x0a << 4)
+#define GC2145_TEST_RED             (0x0c << 4)
+#define GC2145_TEST_BLACK           (0x00 << 4)
+
+/*
+ * Zoom, x100. The 1/2 scaler (P0 0xfd) and the subsampler, which keeps
+ * k of every 5 pixels (P0 0x99), shrink the array before the crop window
+ * takes the output size out of its centre.
+ */
+#define GC2145_ZOOM_UNIT            100
+#define GC2145_SUBSAMPLE_DIV        5
+#define GC2145_SUBSAMPLE_OFF        0x11
+#define GC2145_SUBSAMPLE_5          0x55
+
+enum {
+    GC2145_PAD_MODE_OFF = 0x00,
+    GC2145_PAD_MODE_ON = 0x0F, /* VSYNC, HSYNC, PCLK and data outputs */
+};
+
 enum {
     GC2145_OUTPUT_FMT_UYVY = 0x00,
     GC2145_OUTPUT_FMT_VYUY = 0x01,
     GC2145_OUTPUT_FMT_YUYV = 0x02,
     GC2145_OUTPUT_FMT_YVYU = 0x03,
     GC2145_OUTPUT_FMT_RGB = 0x06,
+    GC2145_OUTPUT_FMT_RGB555 = 0x07, /* x555 */
+    GC2145_OUTPUT_FMT_RGB444 = 0x09, /* x444 */
+    GC2145_OUTPUT_FMT_Y = 0x11, /* Y only, one byte per pixel */
+    GC2145_OUTPUT_FMT_RAW = 0x17, /* Bayer, ISP bypassed */
     GC2145_OUTPUT_FMT_DNDD = 0x18,
     GC2145_OUTPUT_FMT_LSC = 0x19,
 };
@@ -306,112 +485,10 @@ static struct gc2145_reg gc2145_init_regs[] = {
     {0x4b, 0x06},
     {0x4c, 0x20},
     {0xfe, 0x00}, // Select bank0
-    /* GAMMA */
-    /* gamma1 */
-#if 1
-    {0xfe, 0x02}, // Select bank2
-    {0x10, 0x09},
-    {0x11, 0x0d},
-    {0x12, 0x13},
-    {0x13, 0x19},
-    {0x14, 0x27},
-    {0x15, 0x37},
-    {0x16, 0x45},
-    {0x17, 0x53},
-    {0x18, 0x69},
-    {0x19, 0x7d},
-    {0x1a, 0x8f},
-    {0x1b, 0x9d},
-    {0x1c, 0xa9},
-    {0x1d, 0xbd},
-    {0x1e, 0xcd},
-    {0x1f, 0xd9},
-    {0x20, 0xe3},
-    {0x21, 0xea},
-    {0x22, 0xef},
-    {0x23, 0xf5},
-    {0x24, 0xf9},
-    {0x25, 0xff},
-#else
-    {0xfe, 0x02}, // Select bank2
-    {0x10, 0x0a},
-    {0x11, 0x12},
-    {0x12, 0x19},
-    {0x13, 0x1f},
-    {0x14, 0x2c},
-    {0x15, 0x38},
-    {0x16, 0x42},
-    {0x17, 0x4e},
-    {0x18, 0x63},
-    {0x19, 0x76},
-    {0x1a, 0x87},
-    {0x1b, 0x96},
-    {0x1c, 0xa2},
-    {0x1d, 0xb8},
-    {0x1e, 0xcb},
-    {0x1f, 0xd8},
-    {0x20, 0xe2},
-    {0x21, 0xe9},
-    {0x22, 0xf0},
-    {0x23, 0xf8},
-    {0x24, 0xfd},
-    {0x25, 0xff},
-    {0xfe, 0x00}, // Select bank0
-#endif 
+    /* GAMMA, uploaded by gc2145_set_gamma() */
     {0xfe, 0x00}, // Select bank0
     {0xc6, 0x20},
     {0xc7, 0x2b},
-    /* gamma2 */
-#if 1
-    {0xfe, 0x02}, // Select bank2
-    {0x26, 0x0f},
-    {0x27, 0x14},
-    {0x28, 0x19},
-    {0x29, 0x1e},
-    {0x2a, 0x27},
-    {0x2b, 0x33},
-    {0x2c, 0x3b},
-    {0x2d, 0x45},
-    {0x2e, 0x59},
-    {0x2f, 0x69},
-    {0x30, 0x7c},
-    {0x31, 0x89},
-    {0x32, 0x98},
-    {0x33, 0xae},
-    {0x34, 0xc0},
-    {0x35, 0xcf},
-    {0x36, 0xda},
-    {0x37, 0xe2},
-    {0x38, 0xe9},
-    {0x39, 0xf3},
-    {0x3a, 0xf9},
-    {0x3b, 0xff},
-#else
-    /* Gamma outdoor */
-    {0xfe, 0x02}, // Select bank2
-    {0x26, 0x17},
-    {0x27, 0x18},
-    {0x28, 0x1c},
-    {0x29, 0x20},
-    {0x2a, 0x28},
-    {0x2b, 0x34},
-    {0x2c, 0x40},
-    {0x2d, 0x49},
-    {0x2e, 0x5b},
-    {0x2f, 0x6d},
-    {0x30, 0x7d},
-    {0x31, 0x89},
-    {0x32, 0x97},
-    {0x33, 0xac},
-    {0x34, 0xc0},
-    {0x35, 0xcf},
-    {0x36, 0xda},
-    {0x37, 0xe5},
-    {0x38, 0xec},
-    {0x39, 0xf8},
-    {0x3a, 0xfd},
-    {0x3b, 0xff},
-#endif
     /* YCP */
     {0xfe, 0x02}, // Select bank2
     {0xd1, 0x32},
@@ -780,24 +857,12 @@ static struct gc2145_reg gc2145_init_regs[] = {
     {0x46, 0xcf},
     {0xfe, 0x00}, // Select bank0
 
-    /* frame rate 50Hz */
+    /* frame rate, anti-flicker step and levels by gc2145_set_antiflicker() */
     {0xfe, 0x00}, // Select bank0
     {0x05, 0x01},
     {0x06, 0x56},
     {0x07, 0x00},
     {0x08, 0x32},
-    {0xfe, 0x01}, // Select bank1
-    {0x25, 0x00},
-    {0x26, 0xfa},
-    {0x27, 0x04},
-    {0x28, 0xe2}, //20fps 
-    {0x29, 0x06},
-    {0x2a, 0xd6}, //14fps 
-    {0x2b, 0x07},
-    {0x2c, 0xd0}, //12fps
-    {0x2d, 0x0b},
-    {0x2e, 0xb8}, //8fps
-    {0xfe, 0x00}, // Select bank0
     
     {0xfe, 0x00}, // Select bank0
     {0xfd, 0x01},
@@ -957,7 +1022,7 @@ static struct gc2145_reg gc2145_setting_vga[]={
 
 /* 800X600 SVGA,30fps*/
 static struct gc2145_reg gc2145_setting_svga[] ={
-#if 1
+#if 0
     /* gc2145_dvp_svga_20fps */
 	{0xfe, 0x00},
 	{0x05, 0x02},
@@ -1008,7 +1073,7 @@ static struct gc2145_reg gc2145_setting_svga[] ={
 	{0xfe, 0x00},
 	{GC2145_REG_NULL, 0x00},
 #else
-    /* From JV2 */
+    /* From JV2, the state gc2145_init_regs leaves the sensor in */
     {0xfe, 0x00},
     {0xb6, 0x01},
     {0xfd, 0x01}, // {0xfd, 0x00},
@@ -1055,6 +1120,17 @@ static struct gc2145_reg gc2145_setting_svga[] ={
 #endif
 };
 
+/* Raw at the full PCLK after the mode table, one byte per pixel needs no divider */
+static struct gc2145_reg gc2145_setting_raw_full_clk[] = {
+    {0xfe, 0x00},
+    {0xfa, 0x00},
+    {0xfe, 0x01},
+    {0x21, 0x04},
+    {0xfe, 0x00},
+    {0x20, 0x03}, // if 0xfa=00, then 0x20=03
+    {GC2145_REG_NULL, 0x00},
+};
+
 /* 1600X1200 UXGA capture */
 static struct gc2145_reg gc2145_setting_uxga[] ={
     {0xfe, 0x00},
@@ -1100,31 +1176,91 @@ static struct gc2145_reg gc2145_setting_uxga[] ={
     {GC2145_REG_NULL, 0x00},
 };
 
-static struct gc2145_reg gc2145_fmt_yuv422_yuyv[] = {
-    {0x84, 0x02},
+/* Channel gains for the white balance presets, P0 0xb3-0xb5 */
+struct gc2145_wb_preset {
+    unsigned int id;
+    u8 gain[3];
+};
+
+static const struct gc2145_wb_preset gc2145_wb_presets[] = {
+    { V4L2_WHITE_BALANCE_INCANDESCENT, { 0x50, 0x40, 0xa8 } },
+    { V4L2_WHITE_BALANCE_FLUORESCENT, { 0x72, 0x40, 0x5b } },
+    { V4L2_WHITE_BALANCE_DAYLIGHT, { 0x70, 0x40, 0x50 } },
+    { V4L2_WHITE_BALANCE_CLOUDY, { 0x58, 0x40, 0x50 } },
+};
+
+enum {
+    GC2145_GAMMA_DEFAULT,
+    GC2145_GAMMA_BRIGHT_SHADOWS,
+    GC2145_GAMMA_OUTDOOR,
+    GC2145_GAMMA_CUSTOM,
+};
+
+enum {
+    GC2145_BRACKET_OFF,
+    GC2145_BRACKET_ONCE,
+    GC2145_BRACKET_LOOP,
+};
+
+static const char * const gc2145_bracket_menu[] = {
+    "Off",
+    "Once",
+    "Loop",
 };
 
-static struct gc2145_reg gc2145_fmt_yuv422_yvyu[] = {
-    {0x84, 0x03},
+static const char * const gc2145_gamma_menu[] = {
+    "Default",
+    "Bright Shadows",
+    "Outdoor",
+    "Custom",
 };
 
-static struct gc2145_reg gc2145_fmt_yuv422_vyuy[] = {
-    {0x84, 0x01},
+/* Vendor curves, the default pair is gamma1 and gamma2 */
+static const u8 gc2145_gamma_curves[][GC2145_GAMMA_POINTS] = {
+    /* gamma1 */
+    { 0x09, 0x0d, 0x13, 0x19, 0x27, 0x37, 0x45, 0x53, 0x69, 0x7d, 0x8f,
+      0x9d, 0xa9, 0xbd, 0xcd, 0xd9, 0xe3, 0xea, 0xef, 0xf5, 0xf9, 0xff },
+    /* gamma2 */
+    { 0x0f, 0x14, 0x19, 0x1e, 0x27, 0x33, 0x3b, 0x45, 0x59, 0x69, 0x7c,
+      0x89, 0x98, 0xae, 0xc0, 0xcf, 0xda, 0xe2, 0xe9, 0xf3, 0xf9, 0xff },
+    /* bright shadows */
+    { 0x0a, 0x12, 0x19, 0x1f, 0x2c, 0x38, 0x42, 0x4e, 0x63, 0x76, 0x87,
+      0x96, 0xa2, 0xb8, 0xcb, 0xd8, 0xe2, 0xe9, 0xf0, 0xf8, 0xfd, 0xff },
+    /* outdoor */
+    { 0x17, 0x18, 0x1c, 0x20, 0x28, 0x34, 0x40, 0x49, 0x5b, 0x6d, 0x7d,
+      0x89, 0x97, 0xac, 0xc0, 0xcf, 0xda, 0xe5, 0xec, 0xf8, 0xfd, 0xff },
 };
 
-static struct gc2145_reg gc2145_fmt_yuv422_uyvy[] = {
-    {0x84, 0x00},
+static const char * const gc2145_test_pattern_menu[] = {
+    "Disabled",
+    "Color Bars",
+    "Uniform White",
+    "Uniform Yellow",
+    "Uniform Cyan",
+    "Uniform Green",
+    "Uniform Magenta",
+    "Uniform Red",
+    "Uniform Black",
 };
 
-static struct gc2145_reg gc2145_fmt_raw[] = {
-    {0x84, 0x18},
+static const u8 gc2145_test_pattern_val[] = {
+    0,
+    GC2145_TEST_PATTERN_ENABLE,
+    GC2145_TEST_UNIFORM | GC2145_TEST_WHITE,
+    GC2145_TEST_UNIFORM | GC2145_TEST_YELLOW,
+    GC2145_TEST_UNIFORM | GC2145_TEST_CYAN,
+    GC2145_TEST_UNIFORM | GC2145_TEST_GREEN,
+    GC2145_TEST_UNIFORM | GC2145_TEST_MAGENTA,
+    GC2145_TEST_UNIFORM | GC2145_TEST_RED,
+    GC2145_TEST_UNIFORM | GC2145_TEST_BLACK,
 };
 
 struct gc2145_pixfmt {
     unsigned int code;
     unsigned int colorspace;
     unsigned char output_fmt;
-    struct gc2145_reg *fmt_reg;
+    bool byte_swap;
+    bool raw; /* ISP bypassed, white balance left to the host */
 };
 
 static const struct gc2145_pixfmt gc2145_format_list[] = {
@@ -1133,37 +1269,65 @@ static const struct gc2145_pixfmt gc2145_format_list[] = {
         .code = MEDIA_BUS_FMT_UYVY8_2X8,
         .colorspace = V4L2_COLORSPACE_SRGB,
         .output_fmt = GC2145_OUTPUT_FMT_UYVY,
-        .fmt_reg = gc2145_fmt_yuv422_uyvy,
     },
     {
         .code = MEDIA_BUS_FMT_VYUY8_2X8,
         .colorspace = V4L2_COLORSPACE_JPEG,
         .output_fmt = GC2145_OUTPUT_FMT_VYUY,
-        .fmt_reg = gc2145_fmt_yuv422_vyuy,
     },
     {
         .code = MEDIA_BUS_FMT_YUYV8_2X8,
         .colorspace = V4L2_COLORSPACE_SRGB,
         .output_fmt = GC2145_OUTPUT_FMT_YUYV,
-        .fmt_reg = gc2145_fmt_yuv422_yuyv,
     },
     {
         .code = MEDIA_BUS_FMT_YVYU8_2X8,
         .colorspace = V4L2_COLORSPACE_JPEG,
         .output_fmt = GC2145_OUTPUT_FMT_YVYU,
-        .fmt_reg = gc2145_fmt_yuv422_yvyu,
     },
     {
         .code = MEDIA_BUS_FMT_RGB565_2X8_BE,
         .colorspace = V4L2_COLORSPACE_SRGB,
         .output_fmt = GC2145_OUTPUT_FMT_RGB,
-        .fmt_reg = gc2145_fmt_raw,
+    },
+    {
+        .code = MEDIA_BUS_FMT_RGB565_2X8_LE,
+        .colorspace = V4L2_COLORSPACE_SRGB,
+        .output_fmt = GC2145_OUTPUT_FMT_RGB,
+        .byte_swap = true,
+    },
+    {
+        .code = MEDIA_BUS_FMT_RGB555_2X8_PADHI_BE,
+        .colorspace = V4L2_COLORSPACE_SRGB,
+        .output_fmt = GC2145_OUTPUT_FMT_RGB555,
+    },
+    {
+        .code = MEDIA_BUS_FMT_RGB555_2X8_PADHI_LE,
+        .colorspace = V4L2_COLORSPACE_SRGB,
+        .output_fmt = GC2145_OUTPUT_FMT_RGB555,
+        .byte_swap = true,
+    },
+    {
+        .code = MEDIA_BUS_FMT_RGB444_2X8_PADHI_BE,
+        .colorspace = V4L2_COLORSPACE_SRGB,
+        .output_fmt = GC2145_OUTPUT_FMT_RGB444,
+    },
+    {
+        .code = MEDIA_BUS_FMT_RGB444_2X8_PADHI_LE,
+        .colorspace = V4L2_COLORSPACE_SRGB,
+        .output_fmt = GC2145_OUTPUT_FMT_RGB444,
+        .byte_swap = true,
+    },
+    {
+        .code = MEDIA_BUS_FMT_Y8_1X8,
+        .colorspace = V4L2_COLORSPACE_SRGB,
+        .output_fmt = GC2145_OUTPUT_FMT_Y,
     },
     {
         .code = MEDIA_BUS_FMT_SBGGR8_1X8,
         .colorspace = V4L2_COLORSPACE_RAW,
-        .output_fmt = GC2145_OUTPUT_FMT_LSC,
-        .fmt_reg = gc2145_fmt_raw,
+        .output_fmt = GC2145_OUTPUT_FMT_RAW,
+        .raw = true,
     },
 };
 
@@ -1176,6 +1340,35 @@ static const struct gc2145_pixfmt gc2145_format_list[] = {
 #define GC2145_UXGA_WIDTH 1600
 #define GC2145_UXGA_HEIGHT 1200
 
+/*
+ * Sensor timing as programmed by gc2145_init_regs. A row lasts
+ * hb + sh_delay + win_width / 2 + 4 PCLK and a frame win_height + vb + 16
+ * rows. PCLK is 5/4 of xclk before the mode divider (P0 0xfa), which puts
+ * the vendor 50Hz band step of 0xfa rows at exactly 10ms with a 24MHz xclk.
+ */
+#define GC2145_WIN_WIDTH    0x0652
+#define GC2145_WIN_HEIGHT   0x04c0
+#define GC2145_SH_DELAY     0x2e
+#define GC2145_HB_DEFAULT   0x0156
+#define GC2145_VB_DEFAULT   0x0032
+#define GC2145_HTOT(hb)     ((hb) + GC2145_SH_DELAY + GC2145_WIN_WIDTH / 2 + 4)
+#define GC2145_VTOT(vb)     (GC2145_WIN_HEIGHT + (vb) + 16)
+#define GC2145_PCLK_MUL     5
+#define GC2145_PCLK_DIV     4
+
+#define GC2145_EXPOSURE_MAX     0x1fff
+#define GC2145_EXPOSURE_MARGIN  4 /* rows between exposure and frame length */
+#define GC2145_EXPOSURE_DEFAULT 0x04e2
+#define GC2145_GAIN_MIN         0x40 /* 1.0x, 2.6 fixed point */
+#define GC2145_GAIN_MAX         0xff
+#define GC2145_GAIN_DEFAULT     0x40
+#define GC2145_WB_GAIN_DEFAULT  0x40 /* 1.0x */
+
+/* AEC exposure levels, spread from the nominal frame rate down to the floor */
+#define GC2145_EXP_LEVELS       4
+#define GC2145_MIN_FPS_DEFAULT  8
+#define GC2145_MIN_FPS_MAX      30
+
 enum gc2145_mode_id {
     GC2145_MODE_QVGA_320_240 = 0,
     GC2145_MODE_VGA_640_480 = 1,
@@ -1190,6 +1383,8 @@ struct gc2145_mode {
     unsigned int htot;
     unsigned int vact; // Height
     unsigned int vtot;
+    unsigned int clk_div; // PCLK divider, P0 0xfa
+    unsigned int skip_frames; // Frames to drop while the AEC/AWB settle
     const struct gc2145_reg *reg_list;
     unsigned int reg_list_size;
 };
@@ -1198,36 +1393,44 @@ static const struct gc2145_mode gc2145_mode_list[GC2145_MODE_NUM] = {
     {
         .id = GC2145_MODE_QVGA_320_240,
         .hact = 320,
-        .htot = 320,
+        .htot = GC2145_HTOT(GC2145_HB_DEFAULT),
         .vact = 240,
-        .vtot = 240,
+        .vtot = GC2145_VTOT(GC2145_VB_DEFAULT),
+        .clk_div = 1,
+        .skip_frames = 3,
         .reg_list = gc2145_setting_qvga,
         .reg_list_size = ARRAY_SIZE(gc2145_setting_qvga),
     },
     {
         .id = GC2145_MODE_VGA_640_480,
         .hact = 640,
-        .htot = 640,
+        .htot = GC2145_HTOT(GC2145_HB_DEFAULT),
         .vact = 480,
-        .vtot = 480,
+        .vtot = GC2145_VTOT(GC2145_VB_DEFAULT),
+        .clk_div = 1,
+        .skip_frames = 3,
         .reg_list = gc2145_setting_vga,
         .reg_list_size = ARRAY_SIZE(gc2145_setting_vga),
     },
     {
         .id = GC2145_MODE_SVGA_800_600,
         .hact = 800,
-        .htot = 800,
+        .htot = GC2145_HTOT(GC2145_HB_DEFAULT),
         .vact = 600,
-        .vtot = 600,
+        .vtot = GC2145_VTOT(GC2145_VB_DEFAULT),
+        .clk_div = 1,
+        .skip_frames = 3,
         .reg_list = gc2145_setting_svga,
         .reg_list_size = ARRAY_SIZE(gc2145_setting_svga),
     },
     {
         .id = GC2145_MODE_UXGA_1600_1200,
         .hact = 1600,
-        .htot = 1600,
+        .htot = GC2145_HTOT(GC2145_HB_DEFAULT),
         .vact = 1200,
-        .vtot = 1200,
+        .vtot = GC2145_VTOT(GC2145_VB_DEFAULT),
+        .clk_div = 2,
+        .skip_frames = 2,
         .reg_list = gc2145_setting_uxga,
         .reg_list_size = ARRAY_SIZE(gc2145_setting_uxga),
     }
@@ -1247,6 +1450,7 @@ struct gc2145_ctrls {
     struct {
         struct v4l2_ctrl *auto_gain;
         struct v4l2_ctrl *gain;
+        struct v4l2_ctrl *digital_gain;
     };
     struct v4l2_ctrl *brightness;
     struct v4l2_ctrl *light_freq;
@@ -1254,8 +1458,109 @@ struct gc2145_ctrls {
     struct v4l2_ctrl *contrast;
     struct v4l2_ctrl *hue;
     struct v4l2_ctrl *test_pattern;
-    struct v4l2_ctrl *hflip;
-    struct v4l2_ctrl *vflip;
+    struct {
+        struct v4l2_ctrl *hflip;
+        struct v4l2_ctrl *vflip;
+    };
+    struct v4l2_ctrl *aaa_converged;
+    struct v4l2_ctrl *wb_preset;
+    struct v4l2_ctrl *exp_priority;
+    struct v4l2_ctrl *min_fps;
+    struct v4l2_ctrl *gamma;
+    struct v4l2_ctrl *gamma_curve;
+    struct v4l2_ctrl *sharpness;
+    struct v4l2_ctrl *denoise;
+    struct v4l2_ctrl *zoom;
+    struct v4l2_ctrl *stats;
+    struct v4l2_ctrl *bracket;
+    struct v4l2_ctrl *bracket_mode;
+};
+
+struct gc2145_frame_meta {
+    u32 sequence;    /* frame since stream on, estimated without VSYNC */
+    u32 line_ns;     /* row time, exposure * line_ns is the exposure time */
+    u16 exposure;    /* rows */
+    u8 pregain;
+    u8 postgain;
+    u8 wb_gain[3];   /* R, G, B, 0x40 is unity */
+    u8 aec_target;
+    u8 y_avg;        /* AEC luma average */
+    u8 aaa_status;   /* V4L2_CID_GC2145_3A_CONVERGED bits */
+    u8 bracket;      /* V4L2_CID_GC2145_BRACKET entry the frame used */
+} __packed;
+
+/* Power-up order: IOVDD, AVDD then DVDD */
+static const char * const gc2145_supply_names[] = {
+    "iovdd",
+    "avdd",
+    "dvdd",
+};
+
+#define GC2145_NUM_SUPPLIES ARRAY_SIZE(gc2145_supply_names)
+
+struct gc2145_pwr_step {
+    const char *name;
+    s64 t_us; /* offset from the start of the sequence */
+};
+
+struct gc2145_pwr_log {
+    ktime_t start;
+    unsigned int num;
+    struct gc2145_pwr_step step[GC2145_PWR_STEPS_MAX];
+};
+
+/* Who the I2C traffic is for, see gc2145_io_ctx() */
+enum {
+    GC2145_IO_OTHER, /* power, streaming, probe and debugfs */
+    GC2145_IO_INIT,  /* init table */
+    GC2145_IO_MODE,  /* mode table deltas and output format */
+    GC2145_IO_CTRL,  /* controls and the frame write queue */
+    GC2145_IO_STATS, /* metadata and volatile control reads */
+    GC2145_IO_NUM,
+};
+
+struct gc2145_io_stats {
+    u64 writes;    /* registers */
+    u64 reads;     /* registers */
+    u64 transfers;
+    u64 bytes;     /* on the wire, register addresses included */
+    u64 retries;
+    u64 errors;
+    u64 time_ns;
+    u64 max_ns;
+};
+
+/* Subdev ops with a latency histogram */
+enum {
+    GC2145_OP_SET_FMT,
+    GC2145_OP_S_STREAM,
+    GC2145_OP_S_POWER,
+    GC2145_OP_S_CTRL,
+    GC2145_OP_S_CTRL_FLIP,
+    GC2145_OP_NUM,
+};
+
+/* Bucket n counts calls of [2^(n-1), 2^n) us, bucket 0 those under 1 us */
+struct gc2145_lat_hist {
+    u32 bucket[GC2145_LAT_BUCKETS];
+    u64 count;
+    u64 sum_us;
+    u64 max_us;
+};
+
+struct gc2145_zoom {
+    u8 scaler;  /* P0 0xfd */
+    u8 keep;    /* pixels kept out of every GC2145_SUBSAMPLE_DIV */
+    u32 zoom;
+};
+
+/* Converged AEC state kept across stream restarts */
+struct gc2145_aec_seed {
+    bool valid;
+    u16 exposure; /* rows */
+    u8 pregain;
+    u8 postgain;
+    u32 line_ns; /* row time the exposure was captured with */
 };
 
 struct gc2145_dev {
@@ -1267,13 +1572,57 @@ struct gc2145_dev {
     struct clk *xclk; /* system clock to GC2145 */
     struct gpio_desc *reset_gpio;
     struct gpio_desc *pwdn_gpio;
+    struct regulator_bulk_data supplies[GC2145_NUM_SUPPLIES];
+    struct dentry *debugfs;
     /* lock to protect all members below */
     struct mutex lock;
     const struct gc2145_mode *current_mode;
-    const struct gc2145_mode *last_mode;
+    const struct gc2145_mode *last_mode; /* mode the sensor holds, NULL until loaded */
     struct gc2145_ctrls ctrls;
     unsigned int xclk_freq;
     int power_count;
+    bool powered;
+    struct gc2145_pwr_log pwr_on_log;
+    struct gc2145_pwr_log pwr_off_log;
+    bool streaming;
+    u8 page; /* last page selected on the sensor */
+    /* last value written to each register, while powered */
+    u8 shadow[GC2145_PAGES][256];
+    DECLARE_BITMAP(shadow_valid, GC2145_PAGES * 256);
+    /* control writes held in the shadow until the next frame boundary */
+    DECLARE_BITMAP(pending, GC2145_PAGES * 256);
+    bool defer_writes;
+    const struct gc2145_reg *last_table; /* for debugfs */
+    bool last_table_delta;
+    /* I2C accounting, per GC2145_IO_* caller */
+    unsigned int io_ctx;
+    struct gc2145_io_stats io_stats[GC2145_IO_NUM];
+    /* op latency, own lock as s_stream records outside the device lock */
+    spinlock_t lat_lock;
+    struct gc2145_lat_hist lat[GC2145_OP_NUM];
+    bool ctrl_internal; /* set by the driver, kept out of the histogram */
+    /* 3A convergence tracking */
+    struct delayed_work aaa_work;
+    u16 aaa_exposure;
+    u8 aaa_wb[3];
+    unsigned int aaa_stable;
+    /* per-frame metadata events */
+    atomic_t meta_subscribers;
+    ktime_t stream_start;
+    struct gc2145_aec_seed aec_seed;
+    /* optional VSYNC interrupt, frame start and vertical blanking edges */
+    struct gpio_desc *vsync_gpio;
+    int vsync_irq;
+    atomic_t frame_seq; /* index of the frame in flight, -1 before the first */
+    ktime_t frame_ts; /* WRITE_ONCE from the handler */
+    u32 sync_seq; /* frame of the pending V4L2_EVENT_FRAME_SYNC */
+    atomic_t vblank_seq;
+    ktime_t next_poll; /* idle 3A polls skip VSYNC kicks until then */
+    wait_queue_head_t vblank_wq;
+    /* exposure bracketing */
+    unsigned int bracket_next; /* entry queued at the next frame boundary */
+    int bracket_live; /* entry of the frame in flight, -1 if none */
+    u32 bracket_live_entry;
 };
 
 /* General functions */
@@ -1281,10 +1630,19 @@ static inline struct gc2145_dev *to_gc2145_dev(struct v4l2_subdev *sd);
 static inline struct v4l2_subdev *ctrl_to_sd(struct v4l2_ctrl *ctrl);
 static int gc2145_write_reg(struct i2c_client *client, u8 reg, u8 val);
 static int gc2145_read_reg(struct i2c_client *client, u8 reg, u8 *val);
-static int gc2145_write_array(
-    struct i2c_client *client,
+static int gc2145_write_table(
+    struct gc2145_dev *sensor,
     const struct gc2145_reg *regs,
     unsigned int size);
+static int gc2145_read_paged(struct gc2145_dev *sensor, u8 page, u8 reg, u8 *val);
+static int gc2145_read_paged_burst(
+    struct gc2145_dev *sensor, u8 page, u8 reg,
+    u8 *vals, unsigned int len);
+static int gc2145_write_paged(struct gc2145_dev *sensor, u8 page, u8 reg, u8 val);
+static int gc2145_write_paged_burst(
+    struct gc2145_dev *sensor, u8 page, u8 reg,
+    const u8 *vals, unsigned int len);
+static int gc2145_restore_ctrls(struct gc2145_dev *sensor);
 
 static int gc2145_enum_mbus_code(
     struct v4l2_subdev *sd,
@@ -1305,15 +1663,18 @@ static int gc2145_get_fmt(
     struct v4l2_subdev *sd,
     struct v4l2_subdev_pad_config *cfg,
     struct v4l2_subdev_format *format);
+static u32 gc2145_zoom_max(const struct gc2145_mode *mode);
+static void gc2145_zoom_find(const struct gc2145_mode *mode, s32 val, struct gc2145_zoom *best);
 static int gc2145_set_fmt(
     struct v4l2_subdev *sd,
     struct v4l2_subdev_pad_config *cfg,
     struct v4l2_subdev_format *format);
 
 static int gc2145_power(struct gc2145_dev *sensor, bool enable);
-static int gc2145_reset(struct gc2145_dev *sensor);
+static int gc2145_reset(struct gc2145_dev *sensor, bool assert);
 /* soc_camera_ops functions */
 static int gc2145_set_power_on(struct gc2145_dev *sensor);
+static int gc2145_set_power_off(struct gc2145_dev *sensor);
 /* OF probe functions */
 static int gc2145_remove(struct i2c_client *client);
 
@@ -1327,6 +1688,80 @@ static inline struct v4l2_subdev *ctrl_to_sd(struct v4l2_ctrl *ctrl)
     return &container_of(ctrl->handler, struct gc2145_dev, ctrls.handler)->sd;
 }
 
+/* Add the time since start to the histogram of op */
+static void gc2145_lat_record(struct gc2145_dev *sensor, unsigned int op, ktime_t start)
+{
+    struct gc2145_lat_hist *h = &sensor->lat[op];
+    u64 us = ktime_us_delta(ktime_get(), start);
+    spin_lock(&sensor->lat_lock);
+    h->bucket[min_t(unsigned int, fls64(us), GC2145_LAT_BUCKETS - 1)]++;
+    h->count++;
+    h->sum_us += us;
+    h->max_us = max(h->max_us, us);
+    spin_unlock(&sensor->lat_lock);
+}
+
+/* __v4l2_ctrl_s_ctrl() from the driver itself, not timed as S_CTRL */
+static int gc2145_ctrl_set_internal(struct gc2145_dev *sensor, struct v4l2_ctrl *ctrl, s32 val)
+{
+    int ret;
+    sensor->ctrl_internal = true;
+    ret = __v4l2_ctrl_s_ctrl(ctrl, val);
+    sensor->ctrl_internal = false;
+    return ret;
+}
+
+/* Account the following I2C traffic to ctx, returns the previous one */
+static unsigned int gc2145_io_ctx(struct gc2145_dev *sensor, unsigned int ctx)
+{
+    unsigned int prev;
+    lockdep_assert_held(&sensor->lock);
+    prev = sensor->io_ctx;
+    sensor->io_ctx = ctx;
+    return prev;
+}
+
+/*
+ * i2c_transfer() with retries, accounted to the current caller. The stats
+ * are shared with debugfs, every caller holds sensor->lock.
+ */
+static int gc2145_i2c_transfer(struct i2c_client *client, struct i2c_msg *msgs, int num)
+{
+    struct v4l2_subdev *sd = i2c_get_clientdata(client);
+    struct gc2145_dev *sensor;
+    struct gc2145_io_stats *st;
+    unsigned int tries = 0;
+    u64 start, ns;
+    int i, ret;
+    start = ktime_get_ns();
+    do {
+        ret = i2c_transfer(client->adapter, msgs, num);
+    } while (ret < 0 && tries++ < GC2145_I2C_RETRIES);
+    ns = ktime_get_ns() - start;
+    /* Not bound yet during early probe */
+    if (!sd)
+        return ret;
+    sensor = to_gc2145_dev(sd);
+    lockdep_assert_held(&sensor->lock);
+    st = &sensor->io_stats[sensor->io_ctx];
+    st->transfers++;
+    st->retries += min_t(unsigned int, tries, GC2145_I2C_RETRIES);
+    st->time_ns += ns;
+    st->max_ns = max(st->max_ns, ns);
+    if (ret < 0) {
+        st->errors++;
+        return ret;
+    }
+    for (i = 0; i < num; i++) {
+        st->bytes += msgs[i].len;
+        if (msgs[i].flags & I2C_M_RD)
+            st->reads += msgs[i].len;
+        else if (i + 1 == num || !(msgs[i + 1].flags & I2C_M_RD))
+            st->writes += msgs[i].len - 1;
+    }
+    return ret;
+}
+
 static int gc2145_write_reg(struct i2c_client *client, u8 reg, u8 val)
 {
     struct i2c_msg msg;
@@ -1343,7 +1778,7 @@ static int gc2145_write_reg(struct i2c_client *client, u8 reg, u8 val)
     msg.buf = buf;
     msg.len = sizeof(buf);
 
-    ret = i2c_transfer(client->adapter, &msg, 1);
+    ret = gc2145_i2c_transfer(client, &msg, 1);
     if (ret < 0) {
         dev_err(&client->dev, "%s: error: reg=%x, val=%x\n", __func__, reg, val);
         return ret;
@@ -1369,7 +1804,7 @@ static int gc2145_read_reg(struct i2c_client *client, u8 reg, u8 *val)
     msg[1].buf = buf;
     msg[1].len = 1;
 
-    ret = i2c_transfer(client->adapter, msg, 2);
+    ret = gc2145_i2c_transfer(client, msg, 2);
     if (ret < 0) {
         dev_err(&client->dev, "%s: error: reg=%x i2c addr %x\n", __func__, reg, client->addr);
         return ret;
@@ -1382,118 +1817,452 @@ static int gc2145_read_reg(struct i2c_client *client, u8 reg, u8 *val)
     return 0;
 }
 
-static int gc2145_write_array(
-    struct i2c_client *client,
-    const struct gc2145_reg *regs,
-    unsigned int size)
+/* Write consecutive registers in one transfer, the address auto-increments */
+static int gc2145_write_burst(
+    struct i2c_client *client, u8 reg,
+    const u8 *vals, unsigned int len)
 {
-    int ret = 0;
-    unsigned int i = 0;
-    if (client == NULL) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(1)\n", __func__);
-    #endif
-        return -EINVAL;
-    }
-    if (regs == NULL) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(2)\n", __func__);
-    #endif
-        return -EINVAL;
-    }
-    if (size == 0) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(3)\n", __func__);
-    #endif
+    struct i2c_msg msg;
+    u8 buf[GC2145_BURST_MAX + 1];
+    int ret;
+    if (len == 0 || len > GC2145_BURST_MAX)
         return -EINVAL;
-    }
-    for (i = 0; i < size ; i++) {
-        if(regs[i].addr == GC2145_REG_NULL) {
-            mdelay(regs[i].val);
-        } else {
-            ret = gc2145_write_reg(client, regs[i].addr, regs[i].val);
-            if (ret < 0) {
-                dev_err(&client->dev, "%s failed !\n", __func__);
-                break;
-            }
-        }
-    }
 #ifdef GC2145_DEBUG_MSG
-    printk("%s: end(%d)\n", __func__, ret);
+    printk("%s: reg:0x%02X len:%u\n", __func__, reg, len);
 #endif
-    return ret;
+    buf[0] = reg;
+    memcpy(&buf[1], vals, len);
+
+    msg.addr = client->addr;
+    msg.flags = client->flags;
+    msg.buf = buf;
+    msg.len = len + 1;
+
+    ret = gc2145_i2c_transfer(client, &msg, 1);
+    if (ret < 0) {
+        dev_err(&client->dev, "%s: error: reg=%x, len=%u\n", __func__, reg, len);
+        return ret;
+    }
+
+    return 0;
 }
 
-static int gc2145_enum_mbus_code(
-    struct v4l2_subdev *sd,
-    struct v4l2_subdev_pad_config *cfg,
-    struct v4l2_subdev_mbus_code_enum *code)
+/* Read consecutive registers in one transfer */
+static int gc2145_read_burst(
+    struct i2c_client *client, u8 reg,
+    u8 *vals, unsigned int len)
 {
-    struct gc2145_dev *dev = to_gc2145_dev(sd);
-    if (code->pad != 0) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(1)\n", __func__);
-    #endif
-        return -EINVAL;
-    }
-    if (code->index >= ARRAY_SIZE(gc2145_format_list)) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(2)\n", __func__);
-    #endif
-        return -EINVAL;
+    struct i2c_msg msg[2];
+    int ret;
+    msg[0].addr = client->addr;
+    msg[0].flags = client->flags;
+    msg[0].buf = &reg;
+    msg[0].len = 1;
+
+    msg[1].addr = client->addr;
+    msg[1].flags = client->flags | I2C_M_RD;
+    msg[1].buf = vals;
+    msg[1].len = len;
+
+    ret = gc2145_i2c_transfer(client, msg, 2);
+    if (ret < 0) {
+        dev_err(&client->dev, "%s: error: reg=%x, len=%u\n", __func__, reg, len);
+        return ret;
     }
-    mutex_lock(&dev->lock);
-    code->code = gc2145_format_list[code->index].code;
-    mutex_unlock(&dev->lock);
 #ifdef GC2145_DEBUG_MSG
-    printk("%s: index:%d code:%u\n", __func__, code->index, code->code);
+    printk("%s: reg:0x%02X len:%u\n", __func__, reg, len);
 #endif
     return 0;
 }
 
-static const struct gc2145_pixfmt *gc2145_find_pixfmt(unsigned int code)
+static void gc2145_shadow_invalidate(struct gc2145_dev *sensor)
 {
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(gc2145_format_list); i++)
-		if (gc2145_format_list[i].code == code) {
-        #ifdef GC2145_DEBUG_MSG
-            printk("%s: code found:%u\n", __func__, code);
-        #endif
-            break;
-        }
+    bitmap_zero(sensor->shadow_valid, GC2145_PAGES * 256);
+    bitmap_zero(sensor->pending, GC2145_PAGES * 256);
+}
 
-	if (i >= ARRAY_SIZE(gc2145_format_list)) {
-		i = 0;
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: code not found, use default.\n", __func__);
-    #endif
-    }
+static void gc2145_shadow_update(struct gc2145_dev *sensor, u8 page, u8 reg, u8 val)
+{
+    if (reg >= GC2145_REG_GLOBAL)
+        page = 0;
+    if (page >= GC2145_PAGES)
+        return;
+    sensor->shadow[page][reg] = val;
+    set_bit(page * 256 + reg, sensor->shadow_valid);
+    /* A queued write must not land on top of a newer direct one */
+    if (sensor->defer_writes)
+        set_bit(page * 256 + reg, sensor->pending);
+    else
+        clear_bit(page * 256 + reg, sensor->pending);
+}
 
-	return &gc2145_format_list[i];
+static bool gc2145_shadow_get(struct gc2145_dev *sensor, u8 page, u8 reg, u8 *val)
+{
+    if (reg >= GC2145_REG_GLOBAL)
+        page = 0;
+    if (page >= GC2145_PAGES || !test_bit(page * 256 + reg, sensor->shadow_valid))
+        return false;
+    *val = sensor->shadow[page][reg];
+    return true;
 }
 
-static int gc2145_enum_frame_size(
-    struct v4l2_subdev *sd,
-    struct v4l2_subdev_pad_config *cfg,
-    struct v4l2_subdev_frame_size_enum *fse)
+/* Write a register table, tracking the selected page and the shadow */
+static int gc2145_write_table(
+    struct gc2145_dev *sensor,
+    const struct gc2145_reg *regs,
+    unsigned int size)
 {
-    struct gc2145_dev *dev = to_gc2145_dev(sd);
-    unsigned int code;
-    const struct gc2145_pixfmt *gc2145_pixfmt;
-    if (fse->index >= ARRAY_SIZE(gc2145_format_list)) {
+    struct i2c_client *client = sensor->i2c_client;
+    unsigned int i;
+    int ret;
+    if (regs == NULL || size == 0) {
     #ifdef GC2145_DEBUG_MSG
         printk("%s: error(1)\n", __func__);
     #endif
         return -EINVAL;
     }
-    mutex_lock(&dev->lock);
-    gc2145_pixfmt = gc2145_find_pixfmt(fse->code);
-    code = gc2145_pixfmt->code;
-    mutex_unlock(&dev->lock);
-    if (fse->code != code) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(2)\n", __func__);
+    for (i = 0; i < size; i++) {
+        if (regs[i].addr == GC2145_REG_NULL) {
+            mdelay(regs[i].val);
+            continue;
+        }
+        ret = gc2145_write_reg(client, regs[i].addr, regs[i].val);
+        if (ret < 0) {
+            dev_err(&client->dev, "%s failed !\n", __func__);
+            sensor->page = GC2145_PAGE_INVALID;
+            return ret;
+        }
+        if (regs[i].addr != GC2145_REG_PAGE_SELECT) {
+            gc2145_shadow_update(sensor, sensor->page, regs[i].addr, regs[i].val);
+        } else if (regs[i].val < GC2145_PAGES) {
+            sensor->page = regs[i].val;
+        } else {
+            /* 0xf0 is a soft reset, every register is back to default */
+            sensor->page = GC2145_PAGE_INVALID;
+            gc2145_shadow_invalidate(sensor);
+        }
+    }
+    sensor->last_table = regs;
+    sensor->last_table_delta = false;
+    return 0;
+}
+
+static int gc2145_select_page(struct gc2145_dev *sensor, u8 page)
+{
+    int ret;
+    if (sensor->page == page)
+        return 0;
+    ret = gc2145_write_reg(sensor->i2c_client, GC2145_REG_PAGE_SELECT, page);
+    sensor->page = ret < 0 ? GC2145_PAGE_INVALID : page;
+    return ret;
+}
+
+static int gc2145_read_paged(struct gc2145_dev *sensor, u8 page, u8 reg, u8 *val)
+{
+    int ret;
+    ret = gc2145_select_page(sensor, page);
+    if (ret < 0)
+        return ret;
+    return gc2145_read_reg(sensor->i2c_client, reg, val);
+}
+
+static int gc2145_read_paged_burst(
+    struct gc2145_dev *sensor, u8 page, u8 reg,
+    u8 *vals, unsigned int len)
+{
+    int ret;
+    ret = gc2145_select_page(sensor, page);
+    if (ret < 0)
+        return ret;
+    return gc2145_read_burst(sensor->i2c_client, reg, vals, len);
+}
+
+static int gc2145_write_paged(struct gc2145_dev *sensor, u8 page, u8 reg, u8 val)
+{
+    int ret;
+    if (sensor->defer_writes) {
+        gc2145_shadow_update(sensor, page, reg, val);
+        return 0;
+    }
+    ret = gc2145_select_page(sensor, page);
+    if (ret < 0)
+        return ret;
+    ret = gc2145_write_reg(sensor->i2c_client, reg, val);
+    if (ret < 0)
+        return ret;
+    gc2145_shadow_update(sensor, page, reg, val);
+    return 0;
+}
+
+static int gc2145_write_paged_burst(
+    struct gc2145_dev *sensor, u8 page, u8 reg,
+    const u8 *vals, unsigned int len)
+{
+    unsigned int i;
+    int ret;
+    if (!sensor->defer_writes) {
+        ret = gc2145_select_page(sensor, page);
+        if (ret < 0)
+            return ret;
+        ret = gc2145_write_burst(sensor->i2c_client, reg, vals, len);
+        if (ret < 0)
+            return ret;
+    }
+    for (i = 0; i < len; i++)
+        gc2145_shadow_update(sensor, page, reg + i, vals[i]);
+    return 0;
+}
+
+/*
+ * Write every queued register from the shadow in a single i2c_transfer,
+ * one page select per page and one message per run of registers. Only
+ * splits into more transfers if the queue outgrows the message buffer.
+ */
+static int gc2145_flush_writes(struct gc2145_dev *sensor)
+{
+    struct i2c_client *client = sensor->i2c_client;
+    struct i2c_msg msgs[GC2145_QUEUE_MSGS];
+    u8 buf[GC2145_QUEUE_BYTES];
+    unsigned int bit, first, page, reg, len, nmsgs = 0, used = 0;
+    u8 cur = sensor->page;
+    int ret = 0;
+    /* Called on every frame tick, mostly with nothing queued */
+    if (bitmap_empty(sensor->pending, GC2145_PAGES * 256))
+        return 0;
+    /* First register of the batch in flight, for the error report */
+    first = bit = find_first_bit(sensor->pending, GC2145_PAGES * 256);
+    while (bit < GC2145_PAGES * 256) {
+        page = bit / 256;
+        reg = bit % 256;
+        for (len = 1; len < GC2145_BURST_MAX && reg + len < 256; len++) {
+            if (!test_bit(bit + len, sensor->pending))
+                break;
+        }
+        if (nmsgs + 2 > GC2145_QUEUE_MSGS || used + len + 3 > sizeof(buf)) {
+            ret = gc2145_i2c_transfer(client, msgs, nmsgs);
+            if (ret < 0)
+                goto err;
+            nmsgs = used = 0;
+            first = bit;
+        }
+        if (page != cur) {
+            buf[used] = GC2145_REG_PAGE_SELECT;
+            buf[used + 1] = page;
+            msgs[nmsgs].addr = client->addr;
+            msgs[nmsgs].flags = client->flags;
+            msgs[nmsgs].buf = &buf[used];
+            msgs[nmsgs].len = 2;
+            nmsgs++;
+            used += 2;
+            cur = page;
+        }
+        buf[used] = reg;
+        memcpy(&buf[used + 1], &sensor->shadow[page][reg], len);
+        msgs[nmsgs].addr = client->addr;
+        msgs[nmsgs].flags = client->flags;
+        msgs[nmsgs].buf = &buf[used];
+        msgs[nmsgs].len = len + 1;
+        nmsgs++;
+        used += len + 1;
+        bit = find_next_bit(sensor->pending, GC2145_PAGES * 256, bit + len);
+    }
+    if (nmsgs) {
+        ret = gc2145_i2c_transfer(client, msgs, nmsgs);
+        if (ret < 0)
+            goto err;
+    }
+    sensor->page = cur;
+    bitmap_zero(sensor->pending, GC2145_PAGES * 256);
+    return 0;
+err:
+    dev_err(&client->dev, "%s: error: batch from page=%u, reg=%x\n", __func__,
+            first / 256, first % 256);
+    /* Whatever did not land is unknown, let the cached writes retry it */
+    sensor->page = GC2145_PAGE_INVALID;
+    bitmap_andnot(sensor->shadow_valid, sensor->shadow_valid,
+                  sensor->pending, GC2145_PAGES * 256);
+    bitmap_zero(sensor->pending, GC2145_PAGES * 256);
+    return ret;
+}
+
+/*
+ * Write only the span of vals the shadow says differs from the sensor.
+ * Only for registers the sensor never updates on its own, not 3A results.
+ */
+static int gc2145_write_cached_burst(
+    struct gc2145_dev *sensor, u8 page, u8 reg,
+    const u8 *vals, unsigned int len)
+{
+    unsigned int first, last;
+    u8 val;
+    for (first = 0; first < len; first++) {
+        if (!gc2145_shadow_get(sensor, page, reg + first, &val) || val != vals[first])
+            break;
+    }
+    if (first == len)
+        return 0;
+    for (last = len - 1; last > first; last--) {
+        if (!gc2145_shadow_get(sensor, page, reg + last, &val) || val != vals[last])
+            break;
+    }
+    return gc2145_write_paged_burst(sensor, page, reg + first, &vals[first], last - first + 1);
+}
+
+static int gc2145_write_cached(struct gc2145_dev *sensor, u8 page, u8 reg, u8 val)
+{
+    return gc2145_write_cached_burst(sensor, page, reg, &val, 1);
+}
+
+/*
+ * Write the entries of a mode table that differ from the shadow, runs of
+ * consecutive registers as one burst. The mode tables only hold deltas
+ * from the state gc2145_init_regs leaves, so switching between modes
+ * this way gives the same result as a full init.
+ */
+static int gc2145_write_table_delta(
+    struct gc2145_dev *sensor,
+    const struct gc2145_reg *regs,
+    unsigned int size)
+{
+    u8 vals[GC2145_BURST_MAX];
+    u8 page = GC2145_PAGE_INVALID, start = 0;
+    unsigned int i, len = 0;
+    int ret;
+    for (i = 0; i <= size; i++) {
+        /* Flush the run once it breaks */
+        if (len && (i == size || regs[i].addr == GC2145_REG_PAGE_SELECT ||
+                    regs[i].addr == GC2145_REG_NULL ||
+                    regs[i].addr != start + len || len == GC2145_BURST_MAX)) {
+            ret = gc2145_write_cached_burst(sensor, page, start, vals, len);
+            if (ret < 0)
+                return ret;
+            len = 0;
+        }
+        if (i == size)
+            break;
+        if (regs[i].addr == GC2145_REG_PAGE_SELECT) {
+            page = regs[i].val;
+            continue;
+        }
+        if (regs[i].addr == GC2145_REG_NULL) {
+            mdelay(regs[i].val);
+            continue;
+        }
+        if (page >= GC2145_PAGES) {
+        #ifdef GC2145_DEBUG_MSG
+            printk("%s: error(1)\n", __func__);
+        #endif
+            return -EINVAL;
+        }
+        if (len == 0)
+            start = regs[i].addr;
+        vals[len++] = regs[i].val;
+    }
+    sensor->last_table = regs;
+    sensor->last_table_delta = true;
+    return 0;
+}
+
+/*
+ * Raw formats are kept as SBGGR8, the order with the controls at 0.
+ * Mirroring swaps the columns of the CFA and flipping swaps the rows.
+ */
+static u32 gc2145_bayer_code(struct gc2145_dev *sensor, u32 code)
+{
+    static const u32 codes[] = {
+        MEDIA_BUS_FMT_SBGGR8_1X8,
+        MEDIA_BUS_FMT_SGBRG8_1X8,
+        MEDIA_BUS_FMT_SGRBG8_1X8,
+        MEDIA_BUS_FMT_SRGGB8_1X8,
+    };
+    unsigned int i = 0;
+    if (code != MEDIA_BUS_FMT_SBGGR8_1X8)
+        return code;
+    if (sensor->ctrls.hflip->val)
+        i |= 1;
+    if (sensor->ctrls.vflip->val)
+        i |= 2;
+    return codes[i];
+}
+
+static int gc2145_enum_mbus_code(
+    struct v4l2_subdev *sd,
+    struct v4l2_subdev_pad_config *cfg,
+    struct v4l2_subdev_mbus_code_enum *code)
+{
+    struct gc2145_dev *dev = to_gc2145_dev(sd);
+    if (code->pad != 0) {
+    #ifdef GC2145_DEBUG_MSG
+        printk("%s: error(1)\n", __func__);
+    #endif
+        return -EINVAL;
+    }
+    if (code->index >= ARRAY_SIZE(gc2145_format_list)) {
+    #ifdef GC2145_DEBUG_MSG
+        printk("%s: error(2)\n", __func__);
+    #endif
+        return -EINVAL;
+    }
+    mutex_lock(&dev->lock);
+    code->code = gc2145_bayer_code(dev, gc2145_format_list[code->index].code);
+    mutex_unlock(&dev->lock);
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: index:%d code:%u\n", __func__, code->index, code->code);
+#endif
+    return 0;
+}
+
+static const struct gc2145_pixfmt *gc2145_find_pixfmt(unsigned int code)
+{
+	unsigned int i;
+
+    /* Any Bayer order maps to the one raw entry, see gc2145_bayer_code() */
+    switch (code) {
+    case MEDIA_BUS_FMT_SGBRG8_1X8:
+    case MEDIA_BUS_FMT_SGRBG8_1X8:
+    case MEDIA_BUS_FMT_SRGGB8_1X8:
+        code = MEDIA_BUS_FMT_SBGGR8_1X8;
+        break;
+    }
+	for (i = 0; i < ARRAY_SIZE(gc2145_format_list); i++)
+		if (gc2145_format_list[i].code == code) {
+        #ifdef GC2145_DEBUG_MSG
+            printk("%s: code found:%u\n", __func__, code);
+        #endif
+            break;
+        }
+
+	if (i >= ARRAY_SIZE(gc2145_format_list)) {
+		i = 0;
+    #ifdef GC2145_DEBUG_MSG
+        printk("%s: code not found, use default.\n", __func__);
+    #endif
+    }
+
+	return &gc2145_format_list[i];
+}
+
+static int gc2145_enum_frame_size(
+    struct v4l2_subdev *sd,
+    struct v4l2_subdev_pad_config *cfg,
+    struct v4l2_subdev_frame_size_enum *fse)
+{
+    struct gc2145_dev *dev = to_gc2145_dev(sd);
+    unsigned int code;
+    const struct gc2145_pixfmt *gc2145_pixfmt;
+    if (fse->index >= ARRAY_SIZE(gc2145_mode_list)) {
+    #ifdef GC2145_DEBUG_MSG
+        printk("%s: error(1)\n", __func__);
+    #endif
+        return -EINVAL;
+    }
+    mutex_lock(&dev->lock);
+    gc2145_pixfmt = gc2145_find_pixfmt(fse->code);
+    code = gc2145_pixfmt->code;
+    mutex_unlock(&dev->lock);
+    if (fse->code != code) {
+    #ifdef GC2145_DEBUG_MSG
+        printk("%s: error(2)\n", __func__);
     #endif
         return -EINVAL;
     }
@@ -1611,6 +2380,7 @@ static int gc2145_get_fmt(
         fmt = &sensor->fmt;
     }
     format->format = *fmt;
+    format->format.code = gc2145_bayer_code(sensor, fmt->code);
     mutex_unlock(&sensor->lock);
     return 0;
 #else
@@ -1642,6 +2412,146 @@ static int gc2145_get_fmt(
 #endif
 }
 
+static bool gc2145_is_raw(struct gc2145_dev *sensor)
+{
+    return gc2145_find_pixfmt(sensor->fmt.code)->raw;
+}
+
+/*
+ * Raw runs every mode at the full PCLK, see gc2145_setting_raw_full_clk.
+ * Two bytes per pixel with the 1/2 scaler off, zoomed or UXGA, read the
+ * array out at full width and need the divider to fit the bus.
+ */
+static unsigned int gc2145_clk_div(struct gc2145_dev *sensor, const struct gc2145_mode *mode)
+{
+    struct gc2145_zoom z;
+    if (gc2145_is_raw(sensor))
+        return 1;
+    if (mode != sensor->current_mode || !sensor->ctrls.zoom)
+        return mode->clk_div;
+    gc2145_zoom_find(mode, sensor->ctrls.zoom->val, &z);
+    return z.scaler ? mode->clk_div : GC2145_CLK_DIV_UNSCALED;
+}
+
+static u32 gc2145_pclk(struct gc2145_dev *sensor, const struct gc2145_mode *mode)
+{
+    return div_u64((u64)sensor->xclk_freq * GC2145_PCLK_MUL,
+                   GC2145_PCLK_DIV * gc2145_clk_div(sensor, mode));
+}
+
+static u32 gc2145_line_time_ns(struct gc2145_dev *sensor, const struct gc2145_mode *mode)
+{
+    return div_u64((u64)mode->htot * NSEC_PER_SEC, gc2145_pclk(sensor, mode));
+}
+
+static u32 gc2145_frame_time_us(struct gc2145_dev *sensor, const struct gc2145_mode *mode)
+{
+    return div_u64((u64)gc2145_line_time_ns(sensor, mode) * mode->vtot, NSEC_PER_USEC);
+}
+
+static u32 gc2145_exposure_max(const struct gc2145_mode *mode)
+{
+    return min_t(u32, mode->vtot - GC2145_EXPOSURE_MARGIN, GC2145_EXPOSURE_MAX);
+}
+
+/*
+ * Exposure and the gain pair each go out as one burst, so the sensor can
+ * never latch a half written value at the next frame start.
+ */
+static int gc2145_write_exposure(struct gc2145_dev *sensor, u32 exposure)
+{
+    u8 vals[2] = { (exposure >> 8) & 0x1f, exposure & 0xff };
+    return gc2145_write_paged_burst(sensor, 0, GC2145_P0_EXPOSURE_H, vals, sizeof(vals));
+}
+
+static int gc2145_write_gain(struct gc2145_dev *sensor, u8 pregain, u8 postgain)
+{
+    u8 vals[2] = { pregain, postgain };
+    return gc2145_write_paged_burst(sensor, 0, GC2145_P0_PREGAIN, vals, sizeof(vals));
+}
+
+static int gc2145_write_exposure_gain(
+    struct gc2145_dev *sensor, u32 exposure,
+    u8 pregain, u8 postgain)
+{
+    int ret;
+    ret = gc2145_write_exposure(sensor, exposure);
+    if (ret < 0)
+        return ret;
+    return gc2145_write_gain(sensor, pregain, postgain);
+}
+
+static int gc2145_aec_save(struct gc2145_dev *sensor)
+{
+    struct gc2145_aec_seed *seed = &sensor->aec_seed;
+    const struct gc2145_mode *mode = sensor->current_mode;
+    u8 exp[2], gain[2];
+    int ret;
+    /* The same two bursts as gc2145_read_meta() */
+    ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_EXPOSURE_H, exp, sizeof(exp));
+    if (!ret)
+        ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_PREGAIN, gain, sizeof(gain));
+    if (ret < 0) {
+        seed->valid = false;
+        return ret;
+    }
+    seed->exposure = ((exp[0] & 0x1f) << 8) | exp[1];
+    seed->pregain = gain[0];
+    seed->postgain = gain[1];
+    seed->line_ns = gc2145_line_time_ns(sensor, mode);
+    seed->valid = seed->exposure != 0;
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: exp:%u pregain:0x%02x postgain:0x%02x line:%uns\n",
+        __func__, seed->exposure, seed->pregain, seed->postgain, seed->line_ns);
+#endif
+    return 0;
+}
+
+/*
+ * Start the AEC from the last converged point instead of the table
+ * defaults. The exposure is kept constant in time across a change of row
+ * time, any part the new frame length cannot hold moves into the pregain.
+ */
+static int gc2145_aec_seed(struct gc2145_dev *sensor)
+{
+    const struct gc2145_aec_seed *seed = &sensor->aec_seed;
+    const struct gc2145_mode *mode = sensor->current_mode;
+    u32 line_ns = gc2145_line_time_ns(sensor, mode);
+    u32 max_exp = gc2145_exposure_max(mode);
+    u32 exposure, pregain;
+    if (!seed->valid)
+        return 0;
+    exposure = div_u64((u64)seed->exposure * seed->line_ns + line_ns / 2, line_ns);
+    pregain = seed->pregain;
+    if (exposure > max_exp) {
+        pregain = min_t(u32, DIV_ROUND_CLOSEST(pregain * exposure, max_exp), 0xff);
+        exposure = max_exp;
+    }
+    exposure = max_t(u32, exposure, 1);
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: exp:%u->%u pregain:0x%02x->0x%02x\n",
+        __func__, seed->exposure, exposure, seed->pregain, pregain);
+#endif
+    return gc2145_write_exposure_gain(sensor, exposure, pregain, seed->postgain);
+}
+
+static int gc2145_set_output_fmt(struct gc2145_dev *sensor, const struct gc2145_pixfmt *pixfmt)
+{
+    u8 val;
+    int ret;
+    ret = gc2145_write_cached(sensor, 0, GC2145_REG_OUTPUT_FORMAT, pixfmt->output_fmt);
+    if (ret < 0)
+        return ret;
+    /* The tables always write P0 0x89 */
+    if (!gc2145_shadow_get(sensor, 0, GC2145_REG_BYPASS_MODE, &val))
+        return -EINVAL;
+    if (pixfmt->byte_swap)
+        val |= GC2145_BYPASS_MODE_SWITCH;
+    else
+        val &= ~GC2145_BYPASS_MODE_SWITCH;
+    return gc2145_write_cached(sensor, 0, GC2145_REG_BYPASS_MODE, val);
+}
+
 static int gc2145_params_set(
     struct gc2145_dev *sensor,
     struct v4l2_mbus_framefmt *fmt)
@@ -1649,6 +2559,7 @@ static int gc2145_params_set(
     const struct gc2145_pixfmt *pixfmt = NULL;
     // struct gc2145_reg *cfmt_regs_selected;
     // unsigned int cfmt_regs_size;
+    unsigned int ctx;
     int ret;
     pixfmt = gc2145_find_pixfmt(sensor->fmt.code);
     // sensor->current_mode = gc2145_find_mode(sensor, fmt->width, fmt->height, true);
@@ -1660,17 +2571,47 @@ static int gc2145_params_set(
         fmt->width,
         fmt->height);
 #endif
-    // Init
-    ret = gc2145_write_array(sensor->i2c_client, gc2145_init_regs, ARRAY_SIZE(gc2145_init_regs));
-    if (ret < 0)
-        return ret;
+    /* Once loaded, only the mode table deltas are written */
+    ctx = gc2145_io_ctx(sensor, GC2145_IO_INIT);
+    if (!sensor->last_mode) {
+        // Init
+        ret = gc2145_write_table(sensor, gc2145_init_regs, ARRAY_SIZE(gc2145_init_regs));
+        if (ret < 0)
+            goto out;
+        /* The init table enables the outputs, keep them off until s_stream */
+        if (!sensor->streaming) {
+            ret = gc2145_write_paged(sensor, 0, GC2145_REG_PAD_MODE, GC2145_PAD_MODE_OFF);
+            if (ret < 0)
+                goto out;
+        }
+    }
+    gc2145_io_ctx(sensor, GC2145_IO_MODE);
+    ret = gc2145_write_table_delta(sensor, sensor->current_mode->reg_list, sensor->current_mode->reg_list_size);
+    if (ret < 0) {
+        sensor->last_mode = NULL;
+        goto out;
+    }
+    if (pixfmt->raw && sensor->current_mode->clk_div > 1) {
+        ret = gc2145_write_table_delta(sensor, gc2145_setting_raw_full_clk, ARRAY_SIZE(gc2145_setting_raw_full_clk));
+        if (ret < 0) {
+            sensor->last_mode = NULL;
+            goto out;
+        }
+    }
+    sensor->last_mode = sensor->current_mode;
     /* Set the output format */
-    ret = gc2145_write_reg(sensor->i2c_client, GC2145_REG_PAGE_SELECT, 0x00);
+    ret = gc2145_set_output_fmt(sensor, pixfmt);
     if (ret < 0)
-        return ret;
-    ret = gc2145_write_reg(sensor->i2c_client, pixfmt->fmt_reg->addr, pixfmt->fmt_reg->val);
+        goto out;
+    /* Mode changed, the 3A restart from here */
+    sensor->aaa_stable = 0;
+    ret = gc2145_aec_seed(sensor);
     if (ret < 0)
-        return ret;
+        goto out;
+    gc2145_io_ctx(sensor, GC2145_IO_CTRL);
+    ret = gc2145_restore_ctrls(sensor);
+    if (ret < 0)
+        goto out;
 
 // #ifdef GC2145_DEBUG_MSG
 //     printk("%s: width:%u height:%u\r\n", __func__, fmt->width, fmt->height);
@@ -1686,14 +2627,17 @@ static int gc2145_params_set(
     // }
     // ret = gc2145_write_array(sensor->i2c_client, sensor->current_mode->reg_list, sensor->current_mode->reg_list_size);
     // if (ret < 0)
-    //     return ret;
+    //     goto out;
     // fmt->width = sensor->current_mode->hact;
     // fmt->height = sensor->current_mode->vact;
     // if((sensor->current_mode->hact >= 1024) && (sensor->current_mode->vact >= 768))
     // {
     //     msleep(550);
     // }
-    return 0;
+    ret = 0;
+out:
+    gc2145_io_ctx(sensor, ctx);
+    return ret;
 }
 
 static int gc2145_set_fmt(
@@ -1705,6 +2649,8 @@ static int gc2145_set_fmt(
     const struct gc2145_mode *new_mode = NULL;
     struct v4l2_mbus_framefmt *mbus_fmt_in = &format->format;
     struct v4l2_mbus_framefmt *mbus_fmt_out;
+    ktime_t start = ktime_get();
+    struct gc2145_zoom z;
     int ret;
 #ifdef GC2145_DEBUG_MSG
     printk("%s: called\n", __func__);
@@ -1715,8 +2661,6 @@ static int gc2145_set_fmt(
     }
 #if 1
     mutex_lock(&sensor->lock);
-    mbus_fmt_in->width = 800;
-    mbus_fmt_in->height = 600;
     ret = gc2145_try_fmt_internal(sd, mbus_fmt_in, &new_mode);
     if (ret) {
         printk("%s: error(2)\n", __func__);
@@ -1729,22 +2673,40 @@ static int gc2145_set_fmt(
         mbus_fmt_out = v4l2_subdev_get_try_format(sd, cfg, 0);
     } else {
         mbus_fmt_out = &sensor->fmt;
+        /* Save the running exposure against the old mode and format */
+        if (sensor->last_mode && sensor->streaming)
+            gc2145_aec_save(sensor);
     }
     *mbus_fmt_out = *mbus_fmt_in;
     
     if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
     // if (new_mode != sensor->current_mode) {
         sensor->current_mode = new_mode;
+        __v4l2_ctrl_modify_range(sensor->ctrls.exposure, 1,
+            gc2145_exposure_max(new_mode), 1,
+            min_t(u32, GC2145_EXPOSURE_DEFAULT, gc2145_exposure_max(new_mode)));
+        __v4l2_ctrl_modify_range(sensor->ctrls.zoom, GC2145_ZOOM_UNIT,
+            gc2145_zoom_max(new_mode), 1, GC2145_ZOOM_UNIT);
     #ifdef GC2145_DEBUG_MSG
         printk("%s: new_mode found, %dx%d\n", __func__, mbus_fmt_out->width, mbus_fmt_out->height);
     #endif
-        ret = gc2145_params_set(sensor, mbus_fmt_out);
-        if (ret != 0) {
-            printk("%s: error(3)\n", __func__);
+        /* Unpowered, gc2145_s_power() loads the mode on power up */
+        if (sensor->powered) {
+            ret = gc2145_params_set(sensor, mbus_fmt_out);
+            if (ret != 0) {
+                printk("%s: error(3)\n", __func__);
+            }
+        }
+        /* Snap the zoom to a step of the new mode, and apply it if it moved */
+        if (!ret) {
+            gc2145_zoom_find(new_mode, sensor->ctrls.zoom->val, &z);
+            ret = gc2145_ctrl_set_internal(sensor, sensor->ctrls.zoom, z.zoom);
         }
     }
+    mbus_fmt_in->code = gc2145_bayer_code(sensor, mbus_fmt_in->code);
 out:
     mutex_unlock(&sensor->lock);
+    gc2145_lat_record(sensor, GC2145_OP_SET_FMT, start);
     return ret;
 #else
     // mutex_lock(&sensor->lock);
@@ -1777,70 +2739,131 @@ out:
 #endif
 }
 
-static int gc2145_power(struct gc2145_dev *sensor, bool enable)
+static void gc2145_pwr_mark(struct gc2145_pwr_log *log, const char *name)
 {
-    if (!sensor->pwdn_gpio) {
-        printk("%s: error(1)\r\n", __func__);
-        return -1;
-    }
-    if (enable) {
-        gpiod_set_value_cansleep(sensor->pwdn_gpio, 1);
-        udelay(100);
-        gpiod_set_value_cansleep(sensor->pwdn_gpio, 0);
-    } else {
-        gpiod_set_value_cansleep(sensor->pwdn_gpio, 1);
-    }
-    udelay(100);
-#ifdef GC2145_DEBUG_MSG
-    printk("%s: success\r\n", __func__);
+    if (log->num >= GC2145_PWR_STEPS_MAX)
+        return;
+    log->step[log->num].name = name;
+    log->step[log->num].t_us = ktime_us_delta(ktime_get(), log->start);
+    log->num++;
+}
+
+static void gc2145_pwr_log_start(struct gc2145_pwr_log *log)
+{
+    log->num = 0;
+    log->start = ktime_get();
+}
+
+static void gc2145_sleep_us(unsigned int us)
+{
+    usleep_range(us, us + GC2145_T_SLACK_US);
+}
+
+static int gc2145_get_regulators(struct gc2145_dev *sensor)
+{
+    unsigned int i;
+
+    for (i = 0; i < GC2145_NUM_SUPPLIES; i++)
+        sensor->supplies[i].supply = gc2145_supply_names[i];
+
+    return devm_regulator_bulk_get(&sensor->i2c_client->dev,
+                                   GC2145_NUM_SUPPLIES,
+                                   sensor->supplies);
+}
+
+static int gc2145_power(struct gc2145_dev *sensor, bool enable)
+{
+    /* PWDN is optional, boards may tie it low */
+    gpiod_set_value_cansleep(sensor->pwdn_gpio, enable ? 0 : 1);
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: %s\r\n", __func__, enable ? "on" : "off");
 #endif
     return 0;
 }
 
-static int gc2145_reset(struct gc2145_dev *sensor)
+static int gc2145_reset(struct gc2145_dev *sensor, bool assert)
 {
-    if (!sensor->reset_gpio) {
-        printk("%s: error(1)\r\n", __func__);
-        return -1;
-    }
-    /* camera power cycle */
-    gpiod_set_value_cansleep(sensor->reset_gpio, 1);
-    udelay(100);
-    gpiod_set_value_cansleep(sensor->reset_gpio, 0);
-    udelay(100);
+    /* RESETB is optional, boards may tie it high */
+    gpiod_set_value_cansleep(sensor->reset_gpio, assert ? 1 : 0);
 #ifdef GC2145_DEBUG_MSG
-    printk("%s: success\r\n", __func__);
+    printk("%s: %s\r\n", __func__, assert ? "assert" : "release");
 #endif
     return 0;
 }
 
 static int gc2145_set_power_on(struct gc2145_dev *sensor)
 {
+    struct gc2145_pwr_log *log;
+    unsigned int i;
+    int ret;
     if (!sensor) {
         printk("%s: error(1)\r\n", __func__);
-        return -1;
+        return -EINVAL;
     }
-    if (gc2145_power(sensor, true) != 0) {
-        printk("%s: error(2)\r\n", __func__);
-        return -1;
+    if (sensor->powered)
+        return 0;
+    log = &sensor->pwr_on_log;
+    gc2145_pwr_log_start(log);
+    /* Hold the sensor in reset and power down while the rails come up */
+    gc2145_reset(sensor, true);
+    gc2145_power(sensor, false);
+    for (i = 0; i < GC2145_NUM_SUPPLIES; i++) {
+        ret = regulator_enable(sensor->supplies[i].consumer);
+        if (ret) {
+            printk("%s: error(2) %s\r\n", __func__, sensor->supplies[i].supply);
+            goto err_supplies;
+        }
+        gc2145_pwr_mark(log, sensor->supplies[i].supply);
+        if (i + 1 < GC2145_NUM_SUPPLIES)
+            gc2145_sleep_us(GC2145_T_RAIL_US);
     }
-    if (gc2145_reset(sensor) != 0) {
+    ret = clk_prepare_enable(sensor->xclk);
+    if (ret) {
         printk("%s: error(3)\r\n", __func__);
-        return -1;
+        goto err_supplies;
     }
+    gc2145_pwr_mark(log, "xclk");
+    gc2145_sleep_us(GC2145_T_XCLK_US);
+    gc2145_power(sensor, true);
+    gc2145_pwr_mark(log, "pwdn");
+    gc2145_sleep_us(GC2145_T_PWDN_US);
+    gc2145_reset(sensor, false);
+    gc2145_pwr_mark(log, "resetb");
+    gc2145_sleep_us(DIV_ROUND_UP(GC2145_T_RESET_CYCLES, sensor->xclk_freq / 1000000));
+    gc2145_pwr_mark(log, "sccb ready");
+    sensor->powered = true;
 #ifdef GC2145_DEBUG_MSG
-    printk("%s: success\r\n", __func__);
+    printk("%s: success in %lldus\r\n", __func__, log->step[log->num - 1].t_us);
 #endif
     return 0;
+
+err_supplies:
+    while (i--)
+        regulator_disable(sensor->supplies[i].consumer);
+    return ret;
 }
 
 static int gc2145_set_power_off(struct gc2145_dev *sensor)
 {
-    if (gc2145_power(sensor, false) != 0) {
-        printk("%s: error(1)\r\n", __func__);
-        return -1;
-    }
+    struct gc2145_pwr_log *log = &sensor->pwr_off_log;
+    int i;
+    if (!sensor->powered)
+        return 0;
+    gc2145_pwr_log_start(log);
+    gc2145_reset(sensor, true);
+    gc2145_pwr_mark(log, "resetb");
+    gc2145_power(sensor, false);
+    gc2145_pwr_mark(log, "pwdn");
     clk_disable_unprepare(sensor->xclk);
+    gc2145_pwr_mark(log, "xclk");
+    for (i = GC2145_NUM_SUPPLIES - 1; i >= 0; i--) {
+        regulator_disable(sensor->supplies[i].consumer);
+        gc2145_pwr_mark(log, sensor->supplies[i].supply);
+    }
+    sensor->powered = false;
+    sensor->page = GC2145_PAGE_INVALID;
+    gc2145_shadow_invalidate(sensor);
+    sensor->last_mode = NULL;
 #ifdef GC2145_DEBUG_MSG
     printk("%s: success\r\n", __func__);
 #endif
@@ -1855,154 +2878,1086 @@ static int gc2145_s_std(struct v4l2_subdev *sd, v4l2_std_id norm)
     return 0;
 }
 
+/* Exposure, gains and AEC statistics in three burst reads */
+static int gc2145_read_meta(struct gc2145_dev *sensor, struct gc2145_frame_meta *meta)
+{
+    unsigned int ctx = gc2145_io_ctx(sensor, GC2145_IO_STATS);
+    u8 exp[2], gain[5], aec[2];
+    int ret;
+    ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_EXPOSURE_H, exp, sizeof(exp));
+    if (!ret)
+        ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_PREGAIN, gain, sizeof(gain));
+    if (!ret)
+        ret = gc2145_read_paged_burst(sensor, 1, GC2145_P1_AEC_TARGET, aec, sizeof(aec));
+    gc2145_io_ctx(sensor, ctx);
+    if (ret < 0)
+        return ret;
+    memset(meta, 0, sizeof(*meta));
+    /* Without VSYNC the sequence is estimated from the frame time */
+    if (sensor->vsync_irq > 0)
+        meta->sequence = atomic_read(&sensor->frame_seq);
+    else
+        meta->sequence = div_u64(ktime_us_delta(ktime_get(), sensor->stream_start),
+                                 gc2145_frame_time_us(sensor, sensor->current_mode));
+    meta->line_ns = gc2145_line_time_ns(sensor, sensor->current_mode);
+    meta->exposure = ((exp[0] & 0x1f) << 8) | exp[1];
+    meta->pregain = gain[0];
+    meta->postgain = gain[1];
+    memcpy(meta->wb_gain, &gain[2], sizeof(meta->wb_gain));
+    meta->aec_target = aec[0];
+    meta->y_avg = aec[1];
+    meta->bracket = GC2145_BRACKET_NONE;
+    return 0;
+}
+
+static void gc2145_poll_3a(struct gc2145_dev *sensor, struct gc2145_frame_meta *meta, u32 *status)
+{
+    u8 target = meta->aec_target, avg = meta->y_avg;
+    const u8 *wb = meta->wb_gain;
+    u16 exposure = meta->exposure;
+    unsigned int i;
+    bool wb_still = true;
+    for (i = 0; i < ARRAY_SIZE(meta->wb_gain); i++)
+        if (abs((int)wb[i] - (int)sensor->aaa_wb[i]) > GC2145_AWB_MARGIN)
+            wb_still = false;
+    /* Both loops must hold still for a few polls to count as settled */
+    if (exposure == sensor->aaa_exposure && wb_still)
+        sensor->aaa_stable++;
+    else
+        sensor->aaa_stable = 0;
+    sensor->aaa_exposure = exposure;
+    memcpy(sensor->aaa_wb, wb, sizeof(sensor->aaa_wb));
+    *status = 0;
+    if (sensor->aaa_stable >= GC2145_3A_STABLE_POLLS) {
+        /* Off target but parked, e.g. at the exposure limit in the dark */
+        if (abs((int)avg - (int)target) <= GC2145_AE_MARGIN ||
+            sensor->aaa_stable >= 2 * GC2145_3A_STABLE_POLLS)
+            *status |= GC2145_3A_AE_CONVERGED;
+        *status |= GC2145_3A_AWB_CONVERGED;
+    }
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: target:%u avg:%u exp:%u wb:%u/%u/%u status:%u\n",
+        __func__, target, avg, exposure, wb[0], wb[1], wb[2], *status);
+#endif
+}
+
+/*
+ * Get the queued writes flushed at the next frame boundary. VSYNC kicks
+ * the work on its own, otherwise the boundary is estimated from the frame
+ * time since stream on and the 3A poll just comes early.
+ */
+static void gc2145_queue_kick(struct gc2145_dev *sensor)
+{
+    u32 frame_us, rem;
+    if (sensor->vsync_irq > 0)
+        return;
+    frame_us = gc2145_frame_time_us(sensor, sensor->current_mode);
+    div_u64_rem(ktime_us_delta(ktime_get(), sensor->stream_start), frame_us, &rem);
+    mod_delayed_work(system_wq, &sensor->aaa_work, usecs_to_jiffies(frame_us - rem));
+}
+
+/*
+ * Queue the next V4L2_CID_GC2145_BRACKET entry for the frame about to
+ * start, assuming the sensor latches exposure and gain at the next frame.
+ * Returns the entry the finished frame used, -1 if none.
+ */
+static int gc2145_bracket_step(struct gc2145_dev *sensor)
+{
+    struct gc2145_ctrls *ctrls = &sensor->ctrls;
+    const u32 *seq = ctrls->bracket->p_cur.p_u32;
+    int used = sensor->bracket_live;
+    u32 entry;
+    sensor->bracket_live = -1;
+    if (ctrls->bracket_mode->val == GC2145_BRACKET_OFF)
+        return used;
+    if (sensor->bracket_next >= GC2145_BRACKET_MAX || !seq[sensor->bracket_next]) {
+        if (ctrls->bracket_mode->val == GC2145_BRACKET_ONCE || !seq[0]) {
+            /* Done, puts the manual exposure back and tells the listeners */
+            gc2145_ctrl_set_internal(sensor, ctrls->bracket_mode, GC2145_BRACKET_OFF);
+            return used;
+        }
+        sensor->bracket_next = 0;
+    }
+    entry = seq[sensor->bracket_next];
+    sensor->defer_writes = true;
+    gc2145_write_exposure_gain(sensor,
+        min_t(u32, GC2145_BRACKET_EXPOSURE(entry), gc2145_exposure_max(sensor->current_mode)),
+        GC2145_BRACKET_GAIN(entry), GC2145_BRACKET_DIGITAL_GAIN(entry));
+    sensor->defer_writes = false;
+    sensor->bracket_live = sensor->bracket_next++;
+    sensor->bracket_live_entry = entry;
+    return used;
+}
+
+static void gc2145_aaa_work(struct work_struct *work)
+{
+    struct gc2145_dev *sensor = container_of(to_delayed_work(work),
+                                             struct gc2145_dev, aaa_work);
+    struct gc2145_frame_meta meta;
+    struct v4l2_event ev;
+    unsigned int ctx, delay_ms;
+    u32 status, entry;
+    int bracket;
+    mutex_lock(&sensor->lock);
+    if (!sensor->streaming)
+        goto out;
+    /* set_fmt() may switch the mode under us otherwise */
+    delay_ms = DIV_ROUND_UP(gc2145_frame_time_us(sensor, sensor->current_mode), 1000);
+    /* Frame boundary, the queued control writes go first */
+    entry = sensor->bracket_live_entry;
+    ctx = gc2145_io_ctx(sensor, GC2145_IO_CTRL);
+    bracket = gc2145_bracket_step(sensor);
+    gc2145_flush_writes(sensor);
+    gc2145_io_ctx(sensor, ctx);
+    /* Kicked on every vertical blanking, skip frames while idle */
+    if (sensor->vsync_irq > 0 && ktime_before(ktime_get(), sensor->next_poll))
+        goto out;
+    if (gc2145_read_meta(sensor, &meta) == 0) {
+        gc2145_poll_3a(sensor, &meta, &status);
+        /* Emits V4L2_EVENT_CTRL to subscribers on change */
+        gc2145_ctrl_set_internal(sensor, sensor->ctrls.aaa_converged, status);
+        if (atomic_read(&sensor->meta_subscribers)) {
+            /* Every frame while someone listens */
+            meta.aaa_status = status;
+            /* The registers already hold the next entry */
+            if (bracket >= 0) {
+                meta.bracket = bracket;
+                meta.exposure = GC2145_BRACKET_EXPOSURE(entry);
+                meta.pregain = GC2145_BRACKET_GAIN(entry);
+                meta.postgain = GC2145_BRACKET_DIGITAL_GAIN(entry);
+            }
+            memset(&ev, 0, sizeof(ev));
+            ev.type = V4L2_EVENT_GC2145_FRAME_META;
+            ev.id = meta.sequence;
+            memcpy(ev.u.data, &meta, sizeof(meta));
+            v4l2_subdev_notify_event(&sensor->sd, &ev);
+        } else if (status == (GC2145_3A_AE_CONVERGED | GC2145_3A_AWB_CONVERGED)) {
+            delay_ms = GC2145_3A_IDLE_POLL_MS;
+        }
+    }
+    /* The next VSYNC kicks the work again */
+    if (sensor->vsync_irq > 0)
+        sensor->next_poll = delay_ms == GC2145_3A_IDLE_POLL_MS ?
+                            ktime_add_ms(ktime_get(), delay_ms) : 0;
+    else if (sensor->ctrls.bracket_mode->val != GC2145_BRACKET_OFF)
+        gc2145_queue_kick(sensor);
+    else
+        schedule_delayed_work(&sensor->aaa_work, msecs_to_jiffies(delay_ms));
+out:
+    mutex_unlock(&sensor->lock);
+}
+
+/*
+ * One VSYNC edge, level is the line right after it. Frame start counts
+ * the frame, the blanking wakes gc2145_wait_vblank() and kicks the frame
+ * tick on the frame just finished. Never takes the device lock, so
+ * writers may wait for the blanking while holding it.
+ * Returns true on frame start.
+ */
+static bool gc2145_vsync_edge(struct gc2145_dev *sensor, int level)
+{
+    if (level) {
+        WRITE_ONCE(sensor->frame_ts, ktime_get());
+        WRITE_ONCE(sensor->sync_seq, atomic_inc_return(&sensor->frame_seq));
+        return true;
+    }
+    atomic_inc(&sensor->vblank_seq);
+    wake_up_all(&sensor->vblank_wq);
+    mod_delayed_work(system_wq, &sensor->aaa_work, 0);
+    return false;
+}
+
+/*
+ * VSYNC on both edges, told apart here rather than in the thread, which
+ * may only run after the next edge.
+ */
+static irqreturn_t gc2145_vsync_hardirq(int irq, void *dev_id)
+{
+    struct gc2145_dev *sensor = dev_id;
+    int level = gpiod_get_value(sensor->vsync_gpio);
+    /* The pads are off when stopped, anything seen here is noise */
+    if (!READ_ONCE(sensor->streaming) || level < 0)
+        return IRQ_HANDLED;
+    return gc2145_vsync_edge(sensor, level) ? IRQ_WAKE_THREAD : IRQ_HANDLED;
+}
+
+/* V4L2_EVENT_FRAME_SYNC, the bridge notify may sleep */
+static irqreturn_t gc2145_vsync_thread(int irq, void *dev_id)
+{
+    struct gc2145_dev *sensor = dev_id;
+    struct v4l2_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = V4L2_EVENT_FRAME_SYNC;
+    ev.u.frame_sync.frame_sequence = READ_ONCE(sensor->sync_seq);
+    v4l2_subdev_notify_event(&sensor->sd, &ev);
+    return IRQ_HANDLED;
+}
+
+/*
+ * VSYNC behind a GPIO that can sleep, an I2C expander for instance. Those
+ * deliver nested interrupts that never run a primary handler, so the edge
+ * is told apart here from the line as read now.
+ */
+static irqreturn_t gc2145_vsync_nested(int irq, void *dev_id)
+{
+    struct gc2145_dev *sensor = dev_id;
+    int level;
+    if (!READ_ONCE(sensor->streaming))
+        return IRQ_HANDLED;
+    level = gpiod_get_value_cansleep(sensor->vsync_gpio);
+    if (level >= 0 && gc2145_vsync_edge(sensor, level))
+        gc2145_vsync_thread(irq, dev_id);
+    return IRQ_HANDLED;
+}
+
+/* Sleep until the next vertical blanking, a no-op without VSYNC */
+static int gc2145_wait_vblank(struct gc2145_dev *sensor)
+{
+    int seq = atomic_read(&sensor->vblank_seq);
+    long timeout;
+    if (sensor->vsync_irq <= 0 || !sensor->streaming)
+        return 0;
+    timeout = usecs_to_jiffies(2 * gc2145_frame_time_us(sensor, sensor->current_mode));
+    if (!wait_event_timeout(sensor->vblank_wq,
+                            atomic_read(&sensor->vblank_seq) != seq, timeout)) {
+    #ifdef GC2145_DEBUG_MSG
+        printk("%s: timeout\n", __func__);
+    #endif
+        return -ETIMEDOUT;
+    }
+    return 0;
+}
+
 static int gc2145_s_stream(struct v4l2_subdev *sd, int enable)
 {
+    struct gc2145_dev *sensor = to_gc2145_dev(sd);
+    ktime_t start = ktime_get();
+    int ret = 0;
 #ifdef GC2145_DEBUG_MSG
-    printk("%s: called\r\n", __func__);
+    printk("%s: called(%d)\r\n", __func__, enable);
 #endif
+    mutex_lock(&sensor->lock);
+    if (!!enable == sensor->streaming)
+        goto out_unlock;
+    /* Remember where the AEC settled for the next start */
+    if (!enable) {
+        gc2145_flush_writes(sensor);
+        gc2145_aec_save(sensor);
+    }
+    ret = gc2145_write_paged(sensor, 0, GC2145_REG_PAD_MODE,
+                             enable ? GC2145_PAD_MODE_ON : GC2145_PAD_MODE_OFF);
+    /* A failed stop still stops the frame tick */
+    if (ret < 0 && enable)
+        goto out_unlock;
+    WRITE_ONCE(sensor->streaming, enable);
+    if (enable) {
+        sensor->aaa_stable = 0;
+        sensor->stream_start = ktime_get();
+        gc2145_ctrl_set_internal(sensor, sensor->ctrls.aaa_converged, 0);
+        atomic_set(&sensor->frame_seq, -1);
+        sensor->next_poll = 0;
+        sensor->bracket_next = 0;
+        sensor->bracket_live = -1;
+        /* With VSYNC the interrupt drives the frame tick */
+        if (sensor->vsync_irq <= 0)
+            schedule_delayed_work(&sensor->aaa_work,
+                usecs_to_jiffies(gc2145_frame_time_us(sensor, sensor->current_mode)));
+    }
+    mutex_unlock(&sensor->lock);
+    /* The work takes the lock, cancel outside of it */
+    if (!enable)
+        cancel_delayed_work_sync(&sensor->aaa_work);
+    goto out;
+out_unlock:
+    mutex_unlock(&sensor->lock);
+out:
+    gc2145_lat_record(sensor, GC2145_OP_S_STREAM, start);
+    return ret;
+}
+
+static int gc2145_g_skip_frames(struct v4l2_subdev *sd, u32 *frames)
+{
+    struct gc2145_dev *sensor = to_gc2145_dev(sd);
+    mutex_lock(&sensor->lock);
+    *frames = sensor->current_mode->skip_frames;
+    mutex_unlock(&sensor->lock);
     return 0;
 }
 
 static int gc2145_s_power(struct v4l2_subdev *sd, int on)
 {
     struct gc2145_dev *sensor = to_gc2145_dev(sd);
+    ktime_t start = ktime_get();
+    bool stopped = false;
     int ret = 0;
 #ifdef GC2145_DEBUG_MSG
     printk("%s: called\r\n", __func__);
 #endif
-    // mutex_lock(&sensor->lock);
-    if (sensor->power_count == !on) {
+    mutex_lock(&sensor->lock);
+    if (on && sensor->power_count == 0) {
         ret = gc2145_set_power_on(sensor);
         if (ret)
             goto out;
-        // gc2145_write_array(sensor->i2c_client, sensor->current_mode->reg_list, sensor->current_mode->reg_list_size);
+        /* Power off lost every register, load the tables and controls again */
+        if (!sensor->last_mode) {
+            ret = gc2145_params_set(sensor, &sensor->fmt);
+            if (ret) {
+                gc2145_set_power_off(sensor);
+                goto out;
+            }
+        }
+    } else if (!on && sensor->power_count == 1) {
+        /* The stream does not outlive the power, nor does the frame tick */
+        stopped = sensor->streaming;
+        WRITE_ONCE(sensor->streaming, false);
+        gc2145_set_power_off(sensor);
     }
 
     /* Update the power count. */
     sensor->power_count += on ? 1 : -1;
     WARN_ON(sensor->power_count < 0);
 out:
-    // mutex_unlock(&sensor->lock);
+    mutex_unlock(&sensor->lock);
+    /* The work takes the lock, cancel outside of it */
+    if (stopped)
+        cancel_delayed_work_sync(&sensor->aaa_work);
+    gc2145_lat_record(sensor, GC2145_OP_S_POWER, start);
     return ret;
 }
 
 static int gc2145_log_status(struct v4l2_subdev *sd)
 {
+    struct gc2145_dev *sensor = to_gc2145_dev(sd);
 #ifdef GC2145_DEBUG_MSG
     printk("%s: called\r\n", __func__);
 #endif
+    mutex_lock(&sensor->lock);
+    if (sensor->vsync_irq > 0 && sensor->streaming)
+        dev_info(&sensor->i2c_client->dev, "frame %d, started %lld us ago\n",
+                 atomic_read(&sensor->frame_seq),
+                 ktime_us_delta(ktime_get(), READ_ONCE(sensor->frame_ts)));
+    mutex_unlock(&sensor->lock);
     return 0;
 }
 
-static int gc2145_s_vflip(struct i2c_client *client, int value)
+/* HFLIP and VFLIP are clustered, both land in one write of P0 0x17 */
+static int gc2145_set_flip(struct gc2145_dev *sensor)
 {
+    u8 cur, val, orient = GC2145_ORIENT_MOUNT;
     int ret;
-    struct gc2145_reg regs;
-    regs.addr = 0xfe;
-    regs.val = 0x00; //page 0
-    ret = gc2145_write_reg(client, regs.addr, regs.val);
+    /* Applied by gc2145_restore_ctrls() once the tables are loaded */
+    if (!gc2145_shadow_get(sensor, 0, GC2145_P0_ORIENTATION, &cur))
+        return 0;
+    if (sensor->ctrls.hflip->val)
+        orient ^= GC2145_MIRROR;
+    if (sensor->ctrls.vflip->val)
+        orient ^= GC2145_FLIP;
+    val = (cur & ~(GC2145_MIRROR | GC2145_FLIP)) | orient;
+    /* Unchanged, no write and nothing to wait for */
+    if (val == cur)
+        return 0;
+    /* Land the write in the blanking so no frame is half flipped */
+    if (!sensor->defer_writes)
+        gc2145_wait_vblank(sensor);
+    ret = gc2145_write_cached(sensor, 0, GC2145_P0_ORIENTATION, val);
     if (ret < 0) {
     #ifdef GC2145_DEBUG_MSG
         printk("%s: error(1)\r\n", __func__);
     #endif
         return ret;
     }
-    regs.addr = 0x17;
-    ret = gc2145_read_reg(client, regs.addr, &regs.val);
-    if (ret < 0) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(2)\r\n", __func__);
-    #endif
+    /* Let the frame in flight finish, nothing to wait for when stopped */
+    if (sensor->streaming && sensor->vsync_irq <= 0 && !sensor->defer_writes)
+        msleep(20);
+    return 0;
+}
+
+/*
+ * The on-chip AEC drives exposure and gain together, so it only runs
+ * while both clusters are automatic. With one cluster manual, the other
+ * keeps the last value the AEC left in the registers.
+ */
+static bool gc2145_aec_enabled(struct gc2145_dev *sensor)
+{
+    return sensor->ctrls.auto_exp->val == V4L2_EXPOSURE_AUTO &&
+           sensor->ctrls.auto_gain->val;
+}
+
+static int gc2145_set_aec(struct gc2145_dev *sensor)
+{
+    struct gc2145_ctrls *ctrls = &sensor->ctrls;
+    int ret;
+    ret = gc2145_write_paged(sensor, 0, GC2145_P0_AEC_MODE,
+                             gc2145_aec_enabled(sensor) ? GC2145_AEC_ENABLE : 0);
+    if (ret < 0)
         return ret;
+    /* The bracketing sequence owns exposure and gain while it runs */
+    if (ctrls->bracket_mode->val != GC2145_BRACKET_OFF)
+        return 0;
+    if (ctrls->auto_exp->val == V4L2_EXPOSURE_MANUAL) {
+        ret = gc2145_write_exposure(sensor, ctrls->exposure->val);
+        if (ret < 0)
+            return ret;
     }
-    switch (value) {
-        case 0:
-          regs.val &= 0xfd;
-            break;
-        case 1:
-            regs.val |= 0x02;
-            break;
-        default:
-            return -EINVAL;
+    if (!ctrls->auto_gain->val)
+        ret = gc2145_write_gain(sensor, ctrls->gain->val, ctrls->digital_gain->val);
+    return ret;
+}
+
+static const struct gc2145_wb_preset *gc2145_find_wb_preset(unsigned int id)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(gc2145_wb_presets); i++)
+        if (gc2145_wb_presets[i].id == id)
+            return &gc2145_wb_presets[i];
+    return NULL;
+}
+
+/* The AWB runs only with V4L2_CID_AUTO_WHITE_BALANCE set and the AUTO preset */
+static bool gc2145_awb_enabled(struct gc2145_dev *sensor)
+{
+    return sensor->ctrls.auto_wb->val &&
+           sensor->ctrls.wb_preset->val == V4L2_WHITE_BALANCE_AUTO &&
+           !gc2145_is_raw(sensor);
+}
+
+static int gc2145_set_wb(struct gc2145_dev *sensor)
+{
+    struct gc2145_ctrls *ctrls = &sensor->ctrls;
+    const struct gc2145_wb_preset *preset;
+    u8 gain[3];
+    int ret;
+    if (gc2145_awb_enabled(sensor))
+        return gc2145_write_cached(sensor, 0, GC2145_P0_AAA_CTRL,
+                                   GC2145_AAA_CTRL_BASE | GC2145_AWB_ENABLE);
+    ret = gc2145_write_cached(sensor, 0, GC2145_P0_AAA_CTRL, GC2145_AAA_CTRL_BASE);
+    if (ret < 0)
+        return ret;
+    /* A fixed preset or the manual red/blue gains, green stays at unity */
+    preset = gc2145_find_wb_preset(ctrls->wb_preset->val);
+    if (gc2145_is_raw(sensor)) {
+        /* Raw Bayer is left unbalanced */
+        memset(gain, GC2145_WB_GAIN_DEFAULT, sizeof(gain));
+    } else if (preset) {
+        memcpy(gain, preset->gain, sizeof(gain));
+    } else {
+        gain[0] = ctrls->red_balance->val;
+        gain[1] = GC2145_WB_GAIN_DEFAULT;
+        gain[2] = ctrls->blue_balance->val;
     }
-    ret = gc2145_write_reg(client, regs.addr, regs.val);
-    if (ret < 0) {
+    return gc2145_write_paged_burst(sensor, 0, GC2145_P0_AWB_R_GAIN, gain, sizeof(gain));
+}
+
+/* Flicker period in ns, AUTO uses 50ms which is banding free at 50 and 60Hz */
+static u32 gc2145_flicker_period_ns(s32 light_freq)
+{
+    switch (light_freq) {
+    case V4L2_CID_POWER_LINE_FREQUENCY_60HZ:
+        return NSEC_PER_SEC / 120;
+    case V4L2_CID_POWER_LINE_FREQUENCY_AUTO:
+        return NSEC_PER_SEC / 20;
+    case V4L2_CID_POWER_LINE_FREQUENCY_50HZ:
+    default:
+        return NSEC_PER_SEC / 100;
+    }
+}
+
+/*
+ * Exposure rows that fit in one frame at mfps (frame rate in 1/1000 fps).
+ * The 1/8 step of slack absorbs the rounding of the row time, so a 20fps
+ * level at a 40us row time stays at five 10ms steps.
+ */
+static u32 gc2145_exp_level(u32 mfps, u32 line_ns, u32 step)
+{
+    u32 rows = div64_u64(1000ULL * NSEC_PER_SEC, (u64)mfps * line_ns);
+    u32 level = max_t(u32, (rows + step / 8) / step, 1) * step;
+    return min_t(u32, level, GC2145_EXPOSURE_MAX);
+}
+
+/*
+ * The AEC moves exposure in multiples of the anti-flicker step, and
+ * climbs the four exposure levels as the scene darkens, stretching the
+ * frame each time. The levels are spread from the nominal frame rate
+ * down to V4L2_CID_GC2145_MIN_FPS, or all held at the nominal rate when
+ * V4L2_CID_EXPOSURE_AUTO_PRIORITY is cleared. Everything is in rows, so
+ * it follows from the actual row time of the mode.
+ */
+static int gc2145_set_antiflicker(struct gc2145_dev *sensor)
+{
+    const struct gc2145_mode *mode = sensor->current_mode;
+    u32 line_ns = gc2145_line_time_ns(sensor, mode);
+    u32 nominal_mfps = div_u64(1000ULL * USEC_PER_SEC, gc2145_frame_time_us(sensor, mode));
+    u32 min_mfps = min_t(u32, sensor->ctrls.min_fps->val * 1000, nominal_mfps);
+    u32 step, mfps, level;
+    u8 vals[2 + 2 * GC2145_EXP_LEVELS];
+    unsigned int i;
+    step = DIV_ROUND_CLOSEST(gc2145_flicker_period_ns(sensor->ctrls.light_freq->val), line_ns);
+    step = clamp_t(u32, step, 1, GC2145_EXPOSURE_MAX);
+    vals[0] = (step >> 8) & 0x0f;
+    vals[1] = step & 0xff;
+    if (!sensor->ctrls.exp_priority->val)
+        min_mfps = nominal_mfps;
+    for (i = 0; i < GC2145_EXP_LEVELS; i++) {
+        mfps = nominal_mfps - (nominal_mfps - min_mfps) * i / (GC2145_EXP_LEVELS - 1);
+        level = gc2145_exp_level(mfps, line_ns, step);
+        if (mfps == nominal_mfps)
+            level = min_t(u32, level, max_t(u32, gc2145_exposure_max(mode) / step, 1) * step);
+        vals[2 + 2 * i] = (level >> 8) & 0x1f;
+        vals[3 + 2 * i] = level & 0xff;
     #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(3)\r\n", __func__);
+        printk("%s: level%u %u.%03ufps -> %u rows\n", __func__, i, mfps / 1000, mfps % 1000, level);
     #endif
-        return ret;
     }
-    mdelay(20);
-    // info->vflip = value;
-    return 0;
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: line:%uns step:%u\n", __func__, line_ns, step);
+#endif
+    return gc2145_write_cached_burst(sensor, 1, GC2145_P1_ANTIFLICKER_STEP_H, vals, sizeof(vals));
+}
+
+/* YCP block: chroma gains, luma contrast (0x40 = 1.0) and luma offset */
+static int gc2145_set_saturation(struct gc2145_dev *sensor)
+{
+    u8 vals[2] = { sensor->ctrls.saturation->val, sensor->ctrls.saturation->val };
+    return gc2145_write_cached_burst(sensor, 2, GC2145_P2_SATURATION_CB, vals, ARRAY_SIZE(vals));
 }
 
-static int gc2145_s_hflip(struct i2c_client *client, int value)
+static int gc2145_set_contrast(struct gc2145_dev *sensor)
+{
+    return gc2145_write_cached(sensor, 2, GC2145_P2_CONTRAST, sensor->ctrls.contrast->val);
+}
+
+static int gc2145_set_brightness(struct gc2145_dev *sensor)
+{
+    /* signed offset added to Y */
+    return gc2145_write_cached(sensor, 2, GC2145_P2_LUMA_OFFSET, (u8)sensor->ctrls.brightness->val);
+}
+
+/* Edge1 strength, edge2 keeps its table value */
+static int gc2145_set_sharpness(struct gc2145_dev *sensor)
+{
+    u8 val;
+    if (!gc2145_shadow_get(sensor, 2, GC2145_P2_EDGE_EFFECT, &val))
+        return 0;
+    val = (val & 0x0f) | (sensor->ctrls.sharpness->val << 4);
+    return gc2145_write_cached(sensor, 2, GC2145_P2_EDGE_EFFECT, val);
+}
+
+/*
+ * Denoise base and slope in one burst. The slope follows the base so
+ * that 5 gives the tuned 0x05/0x08 and 31 the vendor 0x1f/0x10.
+ */
+static int gc2145_set_denoise(struct gc2145_dev *sensor)
+{
+    int val = sensor->ctrls.denoise->val;
+    u8 vals[2] = { val, 0x08 + (val - GC2145_DENOISE_DEFAULT) / 3 };
+    return gc2145_write_cached_burst(sensor, 2, GC2145_P2_DN_B_BASE, vals, ARRAY_SIZE(vals));
+}
+
+/*
+ * Both gamma slots in one burst. A single curve goes to both slots so it
+ * holds whichever one the ISP picks.
+ */
+static int gc2145_set_gamma(struct gc2145_dev *sensor)
+{
+    u8 vals[2 * GC2145_GAMMA_POINTS];
+    const u8 *curve;
+    switch (sensor->ctrls.gamma->val) {
+    case GC2145_GAMMA_DEFAULT:
+        memcpy(vals, gc2145_gamma_curves[0], GC2145_GAMMA_POINTS);
+        memcpy(&vals[GC2145_GAMMA_POINTS], gc2145_gamma_curves[1], GC2145_GAMMA_POINTS);
+        return gc2145_write_cached_burst(sensor, 2, GC2145_P2_GAMMA1, vals, sizeof(vals));
+    case GC2145_GAMMA_BRIGHT_SHADOWS:
+        curve = gc2145_gamma_curves[2];
+        break;
+    case GC2145_GAMMA_OUTDOOR:
+        curve = gc2145_gamma_curves[3];
+        break;
+    default:
+        curve = sensor->ctrls.gamma_curve->p_cur.p_u8;
+        break;
+    }
+    memcpy(vals, curve, GC2145_GAMMA_POINTS);
+    memcpy(&vals[GC2145_GAMMA_POINTS], curve, GC2145_GAMMA_POINTS);
+    return gc2145_write_cached_burst(sensor, 2, GC2145_P2_GAMMA1, vals, sizeof(vals));
+}
+
+static u32 gc2145_zoom_max(const struct gc2145_mode *mode)
+{
+    /* Scaler off, no subsampling */
+    return GC2145_ZOOM_UNIT * GC2145_UXGA_WIDTH / mode->hact;
+}
+
+/* The setting closest to val that still covers the mode's output size */
+static void gc2145_zoom_find(const struct gc2145_mode *mode, s32 val, struct gc2145_zoom *best)
+{
+    unsigned int div, keep;
+    int scaler;
+    u32 zoom;
+    best->zoom = 0;
+    for (scaler = 1; scaler >= 0; scaler--) {
+        div = scaler ? 2 : 1;
+        for (keep = 1; keep <= GC2145_SUBSAMPLE_DIV; keep++) {
+            if (GC2145_UXGA_WIDTH / div * keep / GC2145_SUBSAMPLE_DIV < mode->hact ||
+                GC2145_UXGA_HEIGHT / div * keep / GC2145_SUBSAMPLE_DIV < mode->vact)
+                continue;
+            zoom = GC2145_ZOOM_UNIT * GC2145_UXGA_WIDTH * keep /
+                (mode->hact * GC2145_SUBSAMPLE_DIV * div);
+            if (best->zoom && abs((s32)zoom - val) >= abs((s32)best->zoom - val))
+                continue;
+            best->scaler = scaler;
+            best->keep = keep;
+            best->zoom = zoom;
+        }
+    }
+}
+
+/* PCLK divider, with the two registers the vendor tables tie to it */
+static int gc2145_write_clk_div(struct gc2145_dev *sensor, unsigned int div)
 {
     int ret;
-    //struct gc2145_info *info = to_state(client);
-    struct gc2145_reg regs;
-    regs.addr = 0xfe;
-    regs.val = 0x00; //page 0
-    ret = gc2145_write_reg(client, regs.addr, regs.val);
-    if (ret < 0) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(1)\r\n", __func__);
-    #endif
-        return ret;
+    ret = gc2145_write_cached(sensor, 0, GC2145_P0_CLK_DIV,
+                              div > 1 ? GC2145_CLK_DIV_HALF : GC2145_CLK_DIV_FULL);
+    if (!ret)
+        ret = gc2145_write_cached(sensor, 1, GC2145_P1_CLK_MODE,
+                                  div > 1 ? GC2145_CLK_MODE_HALF : GC2145_CLK_MODE_FULL_P1);
+    if (!ret)
+        ret = gc2145_write_cached(sensor, 0, GC2145_P0_CLK_MODE,
+                                  div > 1 ? GC2145_CLK_MODE_HALF : GC2145_CLK_MODE_FULL_P0);
+    return ret;
+}
+
+/*
+ * Only the registers that differ from the last setting are written, so
+ * a zoom step while streaming is a burst of a few bytes.
+ */
+static int gc2145_set_zoom(struct gc2145_dev *sensor)
+{
+    const struct gc2145_mode *mode = sensor->current_mode;
+    struct gc2145_zoom z;
+    unsigned int w, h, x, y, i, div;
+    u8 vals[GC2145_P0_SUB_H_POS + 8 - GC2145_P0_CROP_Y_H];
+    u8 *pos = &vals[GC2145_P0_SUB_H_POS - GC2145_P0_CROP_Y_H];
+    unsigned int len = sizeof(vals);
+    u8 clk_div;
+    int ret;
+    /* Applied by gc2145_restore_ctrls() once the tables are loaded */
+    if (!gc2145_shadow_get(sensor, 0, GC2145_P0_SUB_MODE, &vals[GC2145_P0_SUB_MODE - GC2145_P0_CROP_Y_H]) ||
+        !gc2145_shadow_get(sensor, 0, GC2145_P0_CLK_DIV, &clk_div))
+        return 0;
+    gc2145_zoom_find(mode, sensor->ctrls.zoom->val, &z);
+    div = z.scaler ? 2 : 1;
+    w = GC2145_UXGA_WIDTH / div * z.keep / GC2145_SUBSAMPLE_DIV;
+    h = GC2145_UXGA_HEIGHT / div * z.keep / GC2145_SUBSAMPLE_DIV;
+    x = ((w - mode->hact) / 2) & ~1;
+    y = ((h - mode->vact) / 2) & ~1;
+    vals[0] = y >> 8;
+    vals[1] = y & 0xff;
+    vals[2] = x >> 8;
+    vals[3] = x & 0xff;
+    vals[4] = mode->vact >> 8;
+    vals[5] = mode->vact & 0xff;
+    vals[6] = mode->hact >> 8;
+    vals[7] = mode->hact & 0xff;
+    if (z.keep == GC2145_SUBSAMPLE_DIV) {
+        vals[8] = GC2145_SUBSAMPLE_OFF;
+        /* The keep tables are ignored */
+        len = GC2145_P0_SUB_H_POS - GC2145_P0_CROP_Y_H;
+    } else {
+        vals[8] = GC2145_SUBSAMPLE_5;
+        /* Keep the first k positions, packed two per register as the vendor does */
+        for (i = 0; i < 4; i++) {
+            pos[i] = ((2 * i < z.keep ? 2 * i : 0) << 4) |
+                (2 * i + 1 < z.keep ? 2 * i + 1 : 0);
+            pos[i + 4] = pos[i];
+        }
     }
-    regs.addr = 0x17;
-    ret = gc2145_read_reg(client, regs.addr, &regs.val);
-    if (ret < 0) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(2)\r\n", __func__);
-    #endif
+#ifdef GC2145_DEBUG_MSG
+    printk("%s: zoom:%u scaler:%u keep:%u/5 x:%u y:%u\n", __func__, z.zoom, z.scaler, z.keep, x, y);
+#endif
+    /* Scaler off doubles the bytes per row time, halve PCLK as UXGA does */
+    ret = gc2145_write_clk_div(sensor, gc2145_clk_div(sensor, mode));
+    if (ret < 0)
         return ret;
-    }
-    switch (value) {
-        case 0:
-            regs.val &= 0xfe;
+    ret = gc2145_write_cached(sensor, 0, GC2145_P0_SCALER, z.scaler);
+    if (ret < 0)
+        return ret;
+    ret = gc2145_write_cached_burst(sensor, 0, GC2145_P0_CROP_Y_H, vals, len);
+    if (ret < 0)
+        return ret;
+    /* The row time moved with PCLK, the band step in rows with it */
+    gc2145_shadow_get(sensor, 0, GC2145_P0_CLK_DIV, &vals[0]);
+    if (vals[0] != clk_div)
+        ret = gc2145_set_antiflicker(sensor);
+    return ret;
+}
+
+static int gc2145_set_test_pattern(struct gc2145_dev *sensor)
+{
+    return gc2145_write_cached(sensor, 0, GC2145_P0_DEBUG_MODE2,
+        gc2145_test_pattern_val[sensor->ctrls.test_pattern->val]);
+}
+
+static int gc2145_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct gc2145_dev *sensor = to_gc2145_dev(ctrl_to_sd(ctrl));
+    struct gc2145_frame_meta meta;
+    unsigned int ctx;
+    u16 *stats;
+    u8 val[3];
+    int ret = 0;
+    if (!sensor->powered)
+        return 0;
+    ctx = gc2145_io_ctx(sensor, GC2145_IO_STATS);
+    switch (ctrl->id) {
+    case V4L2_CID_EXPOSURE_AUTO:
+        if (ctrl->val != V4L2_EXPOSURE_AUTO)
             break;
-        case 1:
-            regs.val |= 0x01;
+        ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_EXPOSURE_H, val, 2);
+        if (!ret)
+            sensor->ctrls.exposure->val = ((val[0] & 0x1f) << 8) | val[1];
+        break;
+    case V4L2_CID_AUTOGAIN:
+        if (!ctrl->val)
             break;
-        default:
-            return -EINVAL;
+        ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_PREGAIN, val, 2);
+        if (!ret) {
+            sensor->ctrls.gain->val = max_t(u8, val[0], GC2145_GAIN_MIN);
+            sensor->ctrls.digital_gain->val = max_t(u8, val[1], GC2145_GAIN_MIN);
+        }
+        break;
+    case V4L2_CID_AUTO_WHITE_BALANCE:
+        if (!ctrl->val)
+            break;
+        ret = gc2145_read_paged_burst(sensor, 0, GC2145_P0_AWB_R_GAIN, val, 3);
+        if (!ret) {
+            sensor->ctrls.red_balance->val = val[0];
+            sensor->ctrls.blue_balance->val = val[2];
+        }
+        break;
+    case V4L2_CID_GC2145_3A_STATS:
+        ret = gc2145_read_meta(sensor, &meta);
+        if (ret < 0)
+            break;
+        stats = ctrl->p_new.p_u16;
+        stats[GC2145_STAT_Y_AVG] = meta.y_avg;
+        stats[GC2145_STAT_AEC_TARGET] = meta.aec_target;
+        stats[GC2145_STAT_EXPOSURE] = meta.exposure;
+        stats[GC2145_STAT_PREGAIN] = meta.pregain;
+        stats[GC2145_STAT_POSTGAIN] = meta.postgain;
+        stats[GC2145_STAT_WB_R] = meta.wb_gain[0];
+        stats[GC2145_STAT_WB_G] = meta.wb_gain[1];
+        stats[GC2145_STAT_WB_B] = meta.wb_gain[2];
+        break;
     }
-    ret = gc2145_write_reg(client, regs.addr, regs.val);
-    if (ret < 0) {
-    #ifdef GC2145_DEBUG_MSG
-        printk("%s: error(3)\r\n", __func__);
-    #endif
-        return ret;
+    gc2145_io_ctx(sensor, ctx);
+    return ret;
+}
+
+static int gc2145_try_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct gc2145_dev *sensor = to_gc2145_dev(ctrl_to_sd(ctrl));
+    struct gc2145_ctrls *ctrls = &sensor->ctrls;
+    struct gc2145_zoom z;
+    unsigned int i;
+    u32 entry;
+    switch (ctrl->id) {
+    case V4L2_CID_ZOOM_ABSOLUTE:
+        /* Snap to the nearest step the mode can do */
+        gc2145_zoom_find(sensor->current_mode, ctrl->val, &z);
+        ctrl->val = z.zoom;
+        break;
+    case V4L2_CID_GC2145_GAMMA_CURVE:
+        /* The curve must not decrease */
+        for (i = 1; i < GC2145_GAMMA_POINTS; i++) {
+            if (ctrl->p_new.p_u8[i] < ctrl->p_new.p_u8[i - 1])
+                return -EINVAL;
+        }
+        break;
+    case V4L2_CID_GC2145_BRACKET:
+        for (i = 0; i < GC2145_BRACKET_MAX && ctrl->p_new.p_u32[i]; i++) {
+            entry = ctrl->p_new.p_u32[i];
+            if (!GC2145_BRACKET_EXPOSURE(entry) ||
+                GC2145_BRACKET_EXPOSURE(entry) > ctrls->exposure->maximum ||
+                GC2145_BRACKET_GAIN(entry) < GC2145_GAIN_MIN ||
+                GC2145_BRACKET_DIGITAL_GAIN(entry) < GC2145_GAIN_MIN)
+                return -EINVAL;
+        }
+        break;
+    /* Bracketing and the AEC both drive exposure and gain */
+    case V4L2_CID_GC2145_BRACKET_MODE:
+        if (ctrl->val != GC2145_BRACKET_OFF &&
+            (ctrls->auto_exp->val != V4L2_EXPOSURE_MANUAL || ctrls->auto_gain->val))
+            return -EBUSY;
+        break;
+    case V4L2_CID_EXPOSURE_AUTO:
+        if (ctrl->val != V4L2_EXPOSURE_MANUAL && ctrls->bracket_mode->val != GC2145_BRACKET_OFF)
+            return -EBUSY;
+        break;
+    case V4L2_CID_AUTOGAIN:
+        if (ctrl->val && ctrls->bracket_mode->val != GC2145_BRACKET_OFF)
+            return -EBUSY;
+        break;
     }
-    mdelay(20);
     return 0;
 }
 
+static int gc2145_restore_ctrls(struct gc2145_dev *sensor)
+{
+    int ret;
+    ret = gc2145_set_antiflicker(sensor);
+    /* The tables leave the AEC running, only manual settings need a write */
+    if (!ret && !gc2145_aec_enabled(sensor))
+        ret = gc2145_set_aec(sensor);
+    /* Raw turns the AWB off, a mode delta alone would not turn it back on */
+    if (!ret)
+        ret = gc2145_set_wb(sensor);
+    /*
+     * No write at all while these sit at the table defaults, and no
+     * blanking wait for an unchanged flip, a mode delta stays seamless
+     */
+    if (!ret)
+        ret = gc2145_set_flip(sensor);
+    if (!ret)
+        ret = gc2145_set_saturation(sensor);
+    if (!ret)
+        ret = gc2145_set_contrast(sensor);
+    if (!ret)
+        ret = gc2145_set_brightness(sensor);
+    if (!ret)
+        ret = gc2145_set_test_pattern(sensor);
+    if (!ret)
+        ret = gc2145_set_sharpness(sensor);
+    if (!ret)
+        ret = gc2145_set_denoise(sensor);
+    if (!ret)
+        ret = gc2145_set_zoom(sensor);
+    /* The tables leave the gamma curves out */
+    if (!ret)
+        ret = gc2145_set_gamma(sensor);
+    return ret;
+}
+
+static int gc2145_set_bracket_mode(struct gc2145_dev *sensor)
+{
+    /* Starts at the first entry on the next frame boundary */
+    sensor->bracket_next = 0;
+    if (sensor->ctrls.bracket_mode->val != GC2145_BRACKET_OFF)
+        return 0;
+    /* Back to the manual exposure and gain */
+    return gc2145_set_aec(sensor);
+}
+
+static int gc2145_apply_ctrl(struct gc2145_dev *sensor, struct v4l2_ctrl *ctrl)
+{
+    switch (ctrl->id) {
+    case V4L2_CID_EXPOSURE_AUTO:
+    case V4L2_CID_AUTOGAIN:
+        return gc2145_set_aec(sensor);
+    case V4L2_CID_AUTO_WHITE_BALANCE:
+    case V4L2_CID_AUTO_N_PRESET_WHITE_BALANCE:
+        return gc2145_set_wb(sensor);
+    case V4L2_CID_POWER_LINE_FREQUENCY:
+    case V4L2_CID_EXPOSURE_AUTO_PRIORITY:
+    case V4L2_CID_GC2145_MIN_FPS:
+        return gc2145_set_antiflicker(sensor);
+    case V4L2_CID_SATURATION:
+        return gc2145_set_saturation(sensor);
+    case V4L2_CID_CONTRAST:
+        return gc2145_set_contrast(sensor);
+    case V4L2_CID_BRIGHTNESS:
+        return gc2145_set_brightness(sensor);
+    case V4L2_CID_TEST_PATTERN:
+        return gc2145_set_test_pattern(sensor);
+    case V4L2_CID_GC2145_GAMMA:
+    case V4L2_CID_GC2145_GAMMA_CURVE:
+        return gc2145_set_gamma(sensor);
+    case V4L2_CID_SHARPNESS:
+        return gc2145_set_sharpness(sensor);
+    case V4L2_CID_ZOOM_ABSOLUTE:
+        return gc2145_set_zoom(sensor);
+    case V4L2_CID_GC2145_DENOISE:
+        return gc2145_set_denoise(sensor);
+    case V4L2_CID_HFLIP:
+    case V4L2_CID_VFLIP:
+        return gc2145_set_flip(sensor);
+    case V4L2_CID_GC2145_3A_CONVERGED:
+        /* Status only, updated by gc2145_aaa_work() */
+        return 0;
+    case V4L2_CID_GC2145_BRACKET:
+        /* Picked up by gc2145_bracket_step(), from the top */
+        sensor->bracket_next = 0;
+        return 0;
+    case V4L2_CID_GC2145_BRACKET_MODE:
+        return gc2145_set_bracket_mode(sensor);
+    }
+    return -EINVAL;
+}
+
 static int gc2145_s_ctrl(struct v4l2_ctrl *ctrl)
 {
     struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
-    struct i2c_client  *client = v4l2_get_subdevdata(sd);
+    struct gc2145_dev *sensor = to_gc2145_dev(sd);
+    ktime_t start = ktime_get();
+    unsigned int ctx;
+    int ret;
 #ifdef GC2145_DEBUG_MSG
     printk("%s: called\r\n", __func__);
 #endif
-    switch (ctrl->id) {
-    case V4L2_CID_VFLIP:
-        return gc2145_s_vflip(client,ctrl->val);
-    case V4L2_CID_HFLIP:
-        return gc2145_s_hflip(client,ctrl->val);
-    }
-    return -EINVAL;
+    /* Applied by gc2145_params_set() once powered */
+    if (!sensor->powered)
+        return 0;
+    /* While streaming, writes queue up for the next frame boundary */
+    ctx = gc2145_io_ctx(sensor, GC2145_IO_CTRL);
+    sensor->defer_writes = sensor->streaming;
+    ret = gc2145_apply_ctrl(sensor, ctrl);
+    sensor->defer_writes = false;
+    gc2145_io_ctx(sensor, ctx);
+    if (sensor->streaming && !bitmap_empty(sensor->pending, GC2145_PAGES * 256))
+        gc2145_queue_kick(sensor);
+    if (!sensor->ctrl_internal)
+        gc2145_lat_record(sensor, ctrl->id == V4L2_CID_HFLIP || ctrl->id == V4L2_CID_VFLIP ?
+                          GC2145_OP_S_CTRL_FLIP : GC2145_OP_S_CTRL, start);
+    return ret;
 }
 
 static const struct v4l2_ctrl_ops gc2145_ctrl_ops = {
+    .g_volatile_ctrl = gc2145_g_volatile_ctrl,
+    .try_ctrl = gc2145_try_ctrl,
     .s_ctrl = gc2145_s_ctrl,
 };
 
+static const struct v4l2_ctrl_config gc2145_ctrl_3a_converged = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_3A_CONVERGED,
+    .name = "3A Converged",
+    .type = V4L2_CTRL_TYPE_BITMASK,
+    .min = 0,
+    .max = GC2145_3A_AE_CONVERGED | GC2145_3A_AWB_CONVERGED,
+    .def = 0,
+    .flags = V4L2_CTRL_FLAG_READ_ONLY,
+};
+
+static const struct v4l2_ctrl_config gc2145_ctrl_min_fps = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_MIN_FPS,
+    .name = "Minimum Frame Rate",
+    .type = V4L2_CTRL_TYPE_INTEGER,
+    .min = 1,
+    .max = GC2145_MIN_FPS_MAX,
+    .step = 1,
+    .def = GC2145_MIN_FPS_DEFAULT,
+};
+
+static const struct v4l2_ctrl_config gc2145_ctrl_gamma = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_GAMMA,
+    .name = "Gamma Curve",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .max = GC2145_GAMMA_CUSTOM,
+    .def = GC2145_GAMMA_DEFAULT,
+    .qmenu = gc2145_gamma_menu,
+};
+
+/* Used when the gamma curve is set to Custom */
+static const struct v4l2_ctrl_config gc2145_ctrl_gamma_curve = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_GAMMA_CURVE,
+    .name = "Custom Gamma Curve",
+    .type = V4L2_CTRL_TYPE_U8,
+    .min = 0,
+    .max = 0xff,
+    .step = 1,
+    .def = 0,
+    .dims = { GC2145_GAMMA_POINTS },
+};
+
+/* Exposure and gain per frame, see the GC2145_BRACKET_* macros */
+static const struct v4l2_ctrl_config gc2145_ctrl_bracket = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_BRACKET,
+    .name = "Exposure Bracketing",
+    .type = V4L2_CTRL_TYPE_U32,
+    .min = 0,
+    .max = 0xffffffff,
+    .step = 1,
+    .def = 0,
+    .dims = { GC2145_BRACKET_MAX },
+};
+
+static const struct v4l2_ctrl_config gc2145_ctrl_bracket_mode = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_BRACKET_MODE,
+    .name = "Exposure Bracketing Mode",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .max = GC2145_BRACKET_LOOP,
+    .def = GC2145_BRACKET_OFF,
+    .qmenu = gc2145_bracket_menu,
+};
+
+/* Read-only snapshot of the 3A state, see the GC2145_STAT_* indices */
+static const struct v4l2_ctrl_config gc2145_ctrl_3a_stats = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_3A_STATS,
+    .name = "3A Statistics",
+    .type = V4L2_CTRL_TYPE_U16,
+    .min = 0,
+    .max = 0xffff,
+    .step = 1,
+    .def = 0,
+    .dims = { GC2145_STAT_NUM },
+    .flags = V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_READ_ONLY,
+};
+
+static const struct v4l2_ctrl_config gc2145_ctrl_denoise = {
+    .ops = &gc2145_ctrl_ops,
+    .id = V4L2_CID_GC2145_DENOISE,
+    .name = "Noise Reduction",
+    .type = V4L2_CTRL_TYPE_INTEGER,
+    .min = 0,
+    .max = GC2145_DENOISE_MAX,
+    .step = 1,
+    .def = GC2145_DENOISE_DEFAULT,
+};
+
+static int gc2145_meta_event_add(struct v4l2_subscribed_event *sev, unsigned int elems)
+{
+    struct gc2145_dev *sensor = to_gc2145_dev(vdev_to_v4l2_subdev(sev->fh->vdev));
+    atomic_inc(&sensor->meta_subscribers);
+    return 0;
+}
+
+static void gc2145_meta_event_del(struct v4l2_subscribed_event *sev)
+{
+    struct gc2145_dev *sensor = to_gc2145_dev(vdev_to_v4l2_subdev(sev->fh->vdev));
+    atomic_dec(&sensor->meta_subscribers);
+}
+
+static const struct v4l2_subscribed_event_ops gc2145_meta_event_ops = {
+    .add = gc2145_meta_event_add,
+    .del = gc2145_meta_event_del,
+};
+
+static int gc2145_subscribe_event(
+    struct v4l2_subdev *sd,
+    struct v4l2_fh *fh,
+    struct v4l2_event_subscription *sub)
+{
+    struct gc2145_dev *sensor = to_gc2145_dev(sd);
+    if (sub->type == V4L2_EVENT_GC2145_FRAME_META)
+        return v4l2_event_subscribe(fh, sub, GC2145_META_EVENTS, &gc2145_meta_event_ops);
+    if (sub->type == V4L2_EVENT_FRAME_SYNC) {
+        if (sensor->vsync_irq <= 0)
+            return -EINVAL;
+        return v4l2_event_subscribe(fh, sub, GC2145_META_EVENTS, NULL);
+    }
+    return v4l2_ctrl_subdev_subscribe_event(sd, fh, sub);
+}
+
 static const struct v4l2_subdev_core_ops gc2145_core_ops = {
     .s_power = gc2145_s_power,
     .log_status = gc2145_log_status,
+    .subscribe_event = gc2145_subscribe_event,
+    .unsubscribe_event = v4l2_event_subdev_unsubscribe,
 };
 
 static const struct v4l2_subdev_video_ops gc2145_video_ops = {
@@ -2017,33 +3972,359 @@ static const struct v4l2_subdev_pad_ops gc2145_pad_ops = {
     .set_fmt = gc2145_set_fmt,
 };
 
+static const struct v4l2_subdev_sensor_ops gc2145_sensor_ops = {
+    .g_skip_frames = gc2145_g_skip_frames,
+};
+
 static const struct v4l2_subdev_ops gc2145_subdev_ops = {
     .core = &gc2145_core_ops,
     .video = &gc2145_video_ops,
     .pad = &gc2145_pad_ops,
+    .sensor = &gc2145_sensor_ops,
+};
+
+static void gc2145_pwr_log_show(struct seq_file *m, const char *title,
+                                const struct gc2145_pwr_log *log)
+{
+    unsigned int i;
+    s64 prev = 0;
+
+    seq_printf(m, "%s:\n", title);
+    for (i = 0; i < log->num; i++) {
+        seq_printf(m, "  %-12s %6lld us (+%lld us)\n",
+                   log->step[i].name, log->step[i].t_us,
+                   log->step[i].t_us - prev);
+        prev = log->step[i].t_us;
+    }
+}
+
+static int gc2145_power_timing_show(struct seq_file *m, void *unused)
+{
+    struct gc2145_dev *sensor = m->private;
+
+    mutex_lock(&sensor->lock);
+    seq_printf(m, "powered: %d, power_count: %d\n",
+               sensor->powered, sensor->power_count);
+    gc2145_pwr_log_show(m, "power on", &sensor->pwr_on_log);
+    gc2145_pwr_log_show(m, "power off", &sensor->pwr_off_log);
+    mutex_unlock(&sensor->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gc2145_power_timing);
+
+static const char *gc2145_table_name(const struct gc2145_reg *regs)
+{
+    static const char * const mode_names[GC2145_MODE_NUM] = {
+        "qvga", "vga", "svga", "uxga",
+    };
+    unsigned int i;
+    if (!regs)
+        return "none";
+    if (regs == gc2145_init_regs)
+        return "init";
+    if (regs == gc2145_setting_raw_full_clk)
+        return "raw_full_clk";
+    for (i = 0; i < GC2145_MODE_NUM; i++) {
+        if (regs == gc2145_mode_list[i].reg_list)
+            return mode_names[i];
+    }
+    return "unknown";
+}
+
+static int gc2145_state_show(struct seq_file *m, void *unused)
+{
+    struct gc2145_dev *sensor = m->private;
+    const struct gc2145_mode *mode;
+
+    mutex_lock(&sensor->lock);
+    mode = sensor->current_mode;
+    seq_printf(m, "mode: %ux%u (htot %u, vtot %u, clk_div %u)\n",
+               mode->hact, mode->vact, mode->htot, mode->vtot,
+               gc2145_clk_div(sensor, mode));
+    seq_printf(m, "format: 0x%04x, colorspace %u\n",
+               sensor->fmt.code, sensor->fmt.colorspace);
+    seq_printf(m, "frame: %u us, line %u ns\n",
+               gc2145_frame_time_us(sensor, mode), gc2145_line_time_ns(sensor, mode));
+    seq_printf(m, "powered: %d, power_count: %d, streaming: %d\n",
+               sensor->powered, sensor->power_count, sensor->streaming);
+    if (sensor->last_mode)
+        seq_printf(m, "loaded mode: %ux%u\n", sensor->last_mode->hact, sensor->last_mode->vact);
+    else
+        seq_puts(m, "loaded mode: none\n");
+    seq_printf(m, "last table: %s%s\n", gc2145_table_name(sensor->last_table),
+               sensor->last_table && sensor->last_table_delta ? " (delta)" : "");
+    seq_printf(m, "page: 0x%02x\n", sensor->page);
+    if (sensor->vsync_irq > 0)
+        seq_printf(m, "frame_seq: %d\n", atomic_read(&sensor->frame_seq));
+    mutex_unlock(&sensor->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gc2145_state);
+
+static void gc2145_regs_show_page(struct seq_file *m, unsigned int page,
+                                  const u8 *vals, const unsigned long *valid)
+{
+    unsigned int reg;
+
+    seq_printf(m, "page %u:\n", page);
+    for (reg = 0; reg < 256; reg++) {
+        if (reg % 16 == 0)
+            seq_printf(m, "  %02x:", reg);
+        if (valid && !test_bit(page * 256 + reg, valid))
+            seq_puts(m, " --");
+        else
+            seq_printf(m, " %02x", vals[reg]);
+        if (reg % 16 == 15)
+            seq_putc(m, '\n');
+    }
+}
+
+/* Last value written to each register, -- where unknown */
+static int gc2145_regs_cached_show(struct seq_file *m, void *unused)
+{
+    struct gc2145_dev *sensor = m->private;
+    unsigned int page;
+
+    mutex_lock(&sensor->lock);
+    for (page = 0; page < GC2145_PAGES; page++)
+        gc2145_regs_show_page(m, page, sensor->shadow[page], sensor->shadow_valid);
+    mutex_unlock(&sensor->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gc2145_regs_cached);
+
+/* Read back from the sensor, a burst per GC2145_BURST_MAX registers */
+static int gc2145_regs_live_show(struct seq_file *m, void *unused)
+{
+    struct gc2145_dev *sensor = m->private;
+    u8 vals[256];
+    unsigned int page, reg;
+    int ret = 0;
+
+    mutex_lock(&sensor->lock);
+    if (!sensor->powered) {
+        seq_puts(m, "powered off\n");
+        goto out;
+    }
+    for (page = 0; page < GC2145_PAGES; page++) {
+        for (reg = 0; reg < 256; reg += GC2145_BURST_MAX) {
+            ret = gc2145_read_paged_burst(sensor, page, reg, &vals[reg], GC2145_BURST_MAX);
+            if (ret < 0)
+                goto out;
+        }
+        gc2145_regs_show_page(m, page, vals, NULL);
+    }
+out:
+    mutex_unlock(&sensor->lock);
+    return ret;
+}
+DEFINE_SHOW_ATTRIBUTE(gc2145_regs_live);
+
+/*
+ * "<page> <reg> <val>" in hex, through the shadow like any other write.
+ * Not the global registers: the page select, and a soft reset or standby
+ * that would leave the shadow and the loaded mode stale.
+ */
+static ssize_t gc2145_reg_write(struct file *file, const char __user *ubuf,
+                                size_t count, loff_t *ppos)
+{
+    struct gc2145_dev *sensor = file->private_data;
+    unsigned int page, reg, val;
+    char buf[32];
+    ssize_t len;
+    int ret;
+
+    len = simple_write_to_buffer(buf, sizeof(buf) - 1, ppos, ubuf, count);
+    if (len < 0)
+        return len;
+    buf[len] = '\0';
+    if (sscanf(buf, "%x %x %x", &page, &reg, &val) != 3 ||
+        page >= GC2145_PAGES || reg >= GC2145_REG_GLOBAL || val > 0xff)
+        return -EINVAL;
+
+    mutex_lock(&sensor->lock);
+    ret = sensor->powered ? gc2145_write_paged(sensor, page, reg, val) : -EIO;
+    mutex_unlock(&sensor->lock);
+    return ret < 0 ? ret : count;
+}
+
+static const struct file_operations gc2145_reg_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = gc2145_reg_write,
+    .llseek = no_llseek,
 };
 
+static void gc2145_io_stats_row(struct seq_file *m, const char *name,
+                                const struct gc2145_io_stats *st)
+{
+    seq_printf(m, "%-6s %8llu %8llu %8llu %9llu %7llu %6llu %10llu %7llu\n",
+               name, st->writes, st->reads, st->transfers, st->bytes,
+               st->retries, st->errors, div_u64(st->time_ns, NSEC_PER_USEC),
+               div_u64(st->max_ns, NSEC_PER_USEC));
+}
+
+static int gc2145_i2c_stats_show(struct seq_file *m, void *unused)
+{
+    static const char * const names[GC2145_IO_NUM] = {
+        "other", "init", "mode", "ctrl", "stats",
+    };
+    struct gc2145_dev *sensor = m->private;
+    struct gc2145_io_stats total = { 0 };
+    const struct gc2145_io_stats *st;
+    unsigned int i;
+
+    seq_printf(m, "%-6s %8s %8s %8s %9s %7s %6s %10s %7s\n", "caller", "writes",
+               "reads", "xfers", "bytes", "retries", "errors", "time_us", "max_us");
+    mutex_lock(&sensor->lock);
+    for (i = 0; i < GC2145_IO_NUM; i++) {
+        st = &sensor->io_stats[i];
+        gc2145_io_stats_row(m, names[i], st);
+        total.writes += st->writes;
+        total.reads += st->reads;
+        total.transfers += st->transfers;
+        total.bytes += st->bytes;
+        total.retries += st->retries;
+        total.errors += st->errors;
+        total.time_ns += st->time_ns;
+        total.max_ns = max(total.max_ns, st->max_ns);
+    }
+    mutex_unlock(&sensor->lock);
+    gc2145_io_stats_row(m, "total", &total);
+    return 0;
+}
+
+static int gc2145_i2c_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, gc2145_i2c_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t gc2145_i2c_stats_write(struct file *file, const char __user *ubuf,
+                                      size_t count, loff_t *ppos)
+{
+    struct gc2145_dev *sensor = ((struct seq_file *)file->private_data)->private;
+
+    mutex_lock(&sensor->lock);
+    memset(sensor->io_stats, 0, sizeof(sensor->io_stats));
+    mutex_unlock(&sensor->lock);
+    return count;
+}
+
+static const struct file_operations gc2145_i2c_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = gc2145_i2c_stats_open,
+    .read = seq_read,
+    .write = gc2145_i2c_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int gc2145_latency_show(struct seq_file *m, void *unused)
+{
+    static const char * const names[GC2145_OP_NUM] = {
+        "set_fmt", "s_stream", "s_power", "s_ctrl", "s_ctrl (flip)",
+    };
+    struct gc2145_dev *sensor = m->private;
+    struct gc2145_lat_hist h;
+    unsigned int op, i;
+
+    for (op = 0; op < GC2145_OP_NUM; op++) {
+        spin_lock(&sensor->lat_lock);
+        h = sensor->lat[op];
+        spin_unlock(&sensor->lat_lock);
+        seq_printf(m, "%s: count %llu, avg %llu us, max %llu us\n", names[op], h.count,
+                   h.count ? div64_u64(h.sum_us, h.count) : 0, h.max_us);
+        for (i = 0; i < GC2145_LAT_BUCKETS; i++) {
+            if (!h.bucket[i])
+                continue;
+            if (i == GC2145_LAT_BUCKETS - 1)
+                seq_printf(m, "  %8u+ us %10u\n", 1U << (i - 1), h.bucket[i]);
+            else
+                seq_printf(m, "  %8u-%u us %10u\n", i ? 1U << (i - 1) : 0,
+                           1U << i, h.bucket[i]);
+        }
+    }
+    return 0;
+}
+
+static int gc2145_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, gc2145_latency_show, inode->i_private);
+}
+
+/* Any write clears the histograms */
+static ssize_t gc2145_latency_write(struct file *file, const char __user *ubuf,
+                                    size_t count, loff_t *ppos)
+{
+    struct gc2145_dev *sensor = ((struct seq_file *)file->private_data)->private;
+
+    spin_lock(&sensor->lat_lock);
+    memset(sensor->lat, 0, sizeof(sensor->lat));
+    spin_unlock(&sensor->lat_lock);
+    return count;
+}
+
+static const struct file_operations gc2145_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = gc2145_latency_open,
+    .read = seq_read,
+    .write = gc2145_latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void gc2145_debugfs_init(struct gc2145_dev *sensor)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "gc2145-%s", dev_name(&sensor->i2c_client->dev));
+    sensor->debugfs = debugfs_create_dir(name, NULL);
+    debugfs_create_file("power_timing", 0444, sensor->debugfs, sensor,
+                        &gc2145_power_timing_fops);
+    debugfs_create_file("state", 0444, sensor->debugfs, sensor,
+                        &gc2145_state_fops);
+    debugfs_create_file("regs_cached", 0444, sensor->debugfs, sensor,
+                        &gc2145_regs_cached_fops);
+    debugfs_create_file("regs", 0444, sensor->debugfs, sensor,
+                        &gc2145_regs_live_fops);
+    debugfs_create_file("reg_write", 0200, sensor->debugfs, sensor,
+                        &gc2145_reg_fops);
+    debugfs_create_file("i2c_stats", 0644, sensor->debugfs, sensor,
+                        &gc2145_i2c_stats_fops);
+    debugfs_create_file("latency", 0644, sensor->debugfs, sensor,
+                        &gc2145_latency_fops);
+}
+
 static int gc2145_check_chip_id(struct gc2145_dev *sensor)
 {
     struct i2c_client *client = sensor->i2c_client;
     int ret = 0;
     u8 chip_id[2];
 
+    mutex_lock(&sensor->lock);
     ret = gc2145_set_power_on(sensor);
     if (ret) {
+        mutex_unlock(&sensor->lock);
         printk("%s: failed\n", __func__);
         return ret;
     }
 
-    gc2145_read_reg(sensor->i2c_client, GC2145_REG_CHIP_ID_H, &chip_id[0]);
-    gc2145_read_reg(sensor->i2c_client, GC2145_REG_CHIP_ID_L, &chip_id[1]);
+    ret = gc2145_read_reg(sensor->i2c_client, GC2145_REG_CHIP_ID_H, &chip_id[0]);
+    if (!ret)
+        ret = gc2145_read_reg(sensor->i2c_client, GC2145_REG_CHIP_ID_L, &chip_id[1]);
+    /* Powered again by the first s_power(1) */
+    gc2145_set_power_off(sensor);
+    mutex_unlock(&sensor->lock);
+    if (ret) {
+        dev_err(&client->dev, "%s: failed to read chip id\n", __func__);
+        return ret;
+    }
     dev_info(&client->dev, "chip id 0x%x%x\n", chip_id[0], chip_id[1]);
-    if ((chip_id[0] != ((GC2145_CHIP_ID >> 8) & 0xFF)) && (chip_id[1] != (GC2145_REG_CHIP_ID_L & 0xFF))) {
+    if ((chip_id[0] != ((GC2145_CHIP_ID >> 8) & 0xFF)) || (chip_id[1] != (GC2145_CHIP_ID & 0xFF))) {
         dev_err(&client->dev, "%s: wrong chip identifier, expected 0x%03X, got 0x%02X%02X\n",
             __func__, GC2145_CHIP_ID, chip_id[0], chip_id[1]);
-        ret = -ENXIO;
-        gc2145_set_power_off(sensor);
-        return ret;
+        return -ENXIO;
     }
     return 0;
 }
@@ -2063,7 +4344,7 @@ static void gc2145_mode_set_default(struct gc2145_dev *sensor) {
     fmt->height = gc2145_mode_list[GC2145_MODE_SVGA_800_600].vact;
     fmt->field = V4L2_FIELD_NONE;
     sensor->current_mode = &gc2145_mode_list[GC2145_MODE_SVGA_800_600];
-    sensor->last_mode = sensor->current_mode;
+    sensor->last_mode = NULL;
     return;
 }
 
@@ -2111,12 +4392,6 @@ static int gc2145_probe(
         return -EINVAL;
     }
 
-    ret = clk_prepare_enable(sensor->xclk);
-    if (ret) {
-        dev_err(dev, "%s: failed to enable clock\n", __func__);
-        return ret;
-    }
-
     /* request optional power down pin */
     sensor->pwdn_gpio = devm_gpiod_get_optional(dev, "powerdown", GPIOD_OUT_HIGH);
     if (IS_ERR(sensor->pwdn_gpio)) {
@@ -2131,25 +4406,157 @@ static int gc2145_probe(
         return PTR_ERR(sensor->reset_gpio);
     }
 
+    /* request optional vsync pin, the active level marks valid frame lines */
+    sensor->vsync_gpio = devm_gpiod_get_optional(dev, "vsync", GPIOD_IN);
+    if (IS_ERR(sensor->vsync_gpio)) {
+        dev_err(dev, "%s: failed to init vsync pin\n", __func__);
+        return PTR_ERR(sensor->vsync_gpio);
+    }
+
     v4l2_i2c_subdev_init(&sensor->sd, client, &gc2145_subdev_ops);
 
+    mutex_init(&sensor->lock);
+    sensor->page = GC2145_PAGE_INVALID;
+    INIT_DELAYED_WORK(&sensor->aaa_work, gc2145_aaa_work);
+    atomic_set(&sensor->meta_subscribers, 0);
+    atomic_set(&sensor->frame_seq, -1);
+    atomic_set(&sensor->vblank_seq, 0);
+    sensor->bracket_live = -1;
+    init_waitqueue_head(&sensor->vblank_wq);
+    spin_lock_init(&sensor->lat_lock);
+    BUILD_BUG_ON(sizeof(struct gc2145_frame_meta) > sizeof(((struct v4l2_event *)0)->u.data));
+
+    if (sensor->vsync_gpio) {
+        sensor->vsync_irq = gpiod_to_irq(sensor->vsync_gpio);
+        if (sensor->vsync_irq < 0) {
+            dev_err(dev, "%s: no irq for vsync pin\n", __func__);
+            return sensor->vsync_irq;
+        }
+        if (gpiod_cansleep(sensor->vsync_gpio))
+            ret = devm_request_threaded_irq(dev, sensor->vsync_irq, NULL, gc2145_vsync_nested,
+                                            IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING |
+                                            IRQF_ONESHOT, "gc2145-vsync", sensor);
+        else
+            ret = devm_request_threaded_irq(dev, sensor->vsync_irq, gc2145_vsync_hardirq,
+                                            gc2145_vsync_thread,
+                                            IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                                            "gc2145-vsync", sensor);
+        if (ret) {
+            dev_err(dev, "%s: failed to request vsync irq\n", __func__);
+            return ret;
+        }
+    }
+
     /* ctrl */
-    v4l2_ctrl_handler_init(&sensor->ctrls.handler, 3);
+    v4l2_ctrl_handler_init(&sensor->ctrls.handler, 28);
+    /* Controls share the device lock so s_ctrl can touch the sensor state */
+    sensor->ctrls.handler.lock = &sensor->lock;
     v4l2_ctrl_new_std(
         &sensor->ctrls.handler, &gc2145_ctrl_ops,
         V4L2_CID_PIXEL_RATE, 0, GC2145_PIXEL_RATE, 1, GC2145_PIXEL_RATE);
-    v4l2_ctrl_new_std(
+    sensor->ctrls.hflip = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_HFLIP, 0, 1, 1, 0);
+    sensor->ctrls.vflip = v4l2_ctrl_new_std(
         &sensor->ctrls.handler, &gc2145_ctrl_ops,
         V4L2_CID_VFLIP, 0, 1, 1, 0);
-    v4l2_ctrl_new_std(
+    sensor->ctrls.aaa_converged = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_3a_converged, NULL);
+    sensor->ctrls.auto_exp = v4l2_ctrl_new_std_menu(
         &sensor->ctrls.handler, &gc2145_ctrl_ops,
-        V4L2_CID_HFLIP, 0, 1, 1, 0);
+        V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL,
+        ~(BIT(V4L2_EXPOSURE_AUTO) | BIT(V4L2_EXPOSURE_MANUAL)),
+        V4L2_EXPOSURE_AUTO);
+    sensor->ctrls.exposure = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_EXPOSURE, 1, gc2145_exposure_max(sensor->current_mode), 1,
+        GC2145_EXPOSURE_DEFAULT);
+    sensor->ctrls.auto_gain = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_AUTOGAIN, 0, 1, 1, 1);
+    sensor->ctrls.gain = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_ANALOGUE_GAIN, GC2145_GAIN_MIN, GC2145_GAIN_MAX, 1, GC2145_GAIN_DEFAULT);
+    sensor->ctrls.digital_gain = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_DIGITAL_GAIN, GC2145_GAIN_MIN, GC2145_GAIN_MAX, 1, GC2145_GAIN_DEFAULT);
+    sensor->ctrls.auto_wb = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_AUTO_WHITE_BALANCE, 0, 1, 1, 1);
+    sensor->ctrls.blue_balance = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_BLUE_BALANCE, 0, 0xff, 1, GC2145_WB_GAIN_DEFAULT);
+    sensor->ctrls.red_balance = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_RED_BALANCE, 0, 0xff, 1, GC2145_WB_GAIN_DEFAULT);
+    sensor->ctrls.wb_preset = v4l2_ctrl_new_std_menu(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_AUTO_N_PRESET_WHITE_BALANCE, V4L2_WHITE_BALANCE_CLOUDY,
+        ~(BIT(V4L2_WHITE_BALANCE_MANUAL) | BIT(V4L2_WHITE_BALANCE_AUTO) |
+          BIT(V4L2_WHITE_BALANCE_INCANDESCENT) | BIT(V4L2_WHITE_BALANCE_FLUORESCENT) |
+          BIT(V4L2_WHITE_BALANCE_DAYLIGHT) | BIT(V4L2_WHITE_BALANCE_CLOUDY)),
+        V4L2_WHITE_BALANCE_AUTO);
+    sensor->ctrls.light_freq = v4l2_ctrl_new_std_menu(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_AUTO,
+        BIT(V4L2_CID_POWER_LINE_FREQUENCY_DISABLED),
+        V4L2_CID_POWER_LINE_FREQUENCY_50HZ);
+    sensor->ctrls.exp_priority = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_EXPOSURE_AUTO_PRIORITY, 0, 1, 1, 1);
+    sensor->ctrls.min_fps = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_min_fps, NULL);
+    sensor->ctrls.saturation = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_SATURATION, 0, 0xff, 1, GC2145_SATURATION_DEFAULT);
+    sensor->ctrls.contrast = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_CONTRAST, 0, 0xff, 1, GC2145_CONTRAST_DEFAULT);
+    sensor->ctrls.brightness = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_BRIGHTNESS, -128, 127, 1, 0);
+    sensor->ctrls.test_pattern = v4l2_ctrl_new_std_menu_items(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_TEST_PATTERN, ARRAY_SIZE(gc2145_test_pattern_menu) - 1,
+        0, 0, gc2145_test_pattern_menu);
+    sensor->ctrls.gamma = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_gamma, NULL);
+    sensor->ctrls.gamma_curve = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_gamma_curve, NULL);
+    sensor->ctrls.sharpness = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_SHARPNESS, 0, 0x0f, 1, GC2145_SHARPNESS_DEFAULT);
+    sensor->ctrls.denoise = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_denoise, NULL);
+    sensor->ctrls.zoom = v4l2_ctrl_new_std(
+        &sensor->ctrls.handler, &gc2145_ctrl_ops,
+        V4L2_CID_ZOOM_ABSOLUTE, GC2145_ZOOM_UNIT,
+        gc2145_zoom_max(sensor->current_mode), 1, GC2145_ZOOM_UNIT);
+    sensor->ctrls.stats = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_3a_stats, NULL);
+    sensor->ctrls.bracket = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_bracket, NULL);
+    sensor->ctrls.bracket_mode = v4l2_ctrl_new_custom(
+        &sensor->ctrls.handler, &gc2145_ctrl_bracket_mode, NULL);
     sensor->sd.ctrl_handler = &sensor->ctrls.handler;
     if (sensor->ctrls.handler.error) {
         dev_err(dev, "%s: control initialization error %d\n", __func__, sensor->ctrls.handler.error);
         ret = sensor->ctrls.handler.error;
         goto LABEL_FREE;
     }
+    sensor->ctrls.exposure->flags |= V4L2_CTRL_FLAG_VOLATILE;
+    sensor->ctrls.gain->flags |= V4L2_CTRL_FLAG_VOLATILE;
+    sensor->ctrls.digital_gain->flags |= V4L2_CTRL_FLAG_VOLATILE;
+    v4l2_ctrl_auto_cluster(2, &sensor->ctrls.auto_exp, V4L2_EXPOSURE_MANUAL, true);
+    v4l2_ctrl_auto_cluster(3, &sensor->ctrls.auto_gain, 0, true);
+    v4l2_ctrl_auto_cluster(3, &sensor->ctrls.auto_wb, 0, true);
+    /* Flips change the Bayer order of the raw format */
+    sensor->ctrls.hflip->flags |= V4L2_CTRL_FLAG_MODIFY_LAYOUT;
+    sensor->ctrls.vflip->flags |= V4L2_CTRL_FLAG_MODIFY_LAYOUT;
+    v4l2_ctrl_cluster(2, &sensor->ctrls.hflip);
+    /* Start the custom curve from gamma1 rather than all zeroes */
+    memcpy(sensor->ctrls.gamma_curve->p_cur.p_u8, gc2145_gamma_curves[0], GC2145_GAMMA_POINTS);
+    memcpy(sensor->ctrls.gamma_curve->p_new.p_u8, gc2145_gamma_curves[0], GC2145_GAMMA_POINTS);
 
     /* Initialize subdev */
     sensor->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE | V4L2_SUBDEV_FL_HAS_EVENTS;
@@ -2158,36 +4565,37 @@ static int gc2145_probe(
     ret = media_entity_pads_init(&sensor->sd.entity, 1, &sensor->pad);
     if (ret) {
         dev_err(dev, "%s: media_entity_pads_init() failed\n", __func__);
-        return ret;
+        goto LABEL_FREE;
     }
 
-    // ret = gc2145_get_regulators(sensor);
-    // if (ret)
-    // return ret;
-
-    mutex_init(&sensor->lock);
+    ret = gc2145_get_regulators(sensor);
+    if (ret) {
+        dev_err(dev, "%s: failed to get regulators\n", __func__);
+        goto LABEL_FREE;
+    }
 
     ret = gc2145_check_chip_id(sensor);
     if (ret) {
         dev_err(dev, "%s: gc2145 chip id check failed\n", __func__);
-        goto LABEL_CLEANUP;
+        goto LABEL_FREE;
     }
 
     // ret = gc2145_init_controls(sensor);
     ret = v4l2_ctrl_handler_setup(&sensor->ctrls.handler);
     if (ret)
-        goto LABEL_CLEANUP;
+        goto LABEL_FREE;
 
     ret = v4l2_async_register_subdev_sensor_common(&sensor->sd);
     if (ret) {
         dev_err(dev, "%s: v4l2 register subdev failed\n", __func__);
         goto LABEL_FREE;
     }
+    gc2145_debugfs_init(sensor);
     return 0;
 
 LABEL_FREE:
     v4l2_ctrl_handler_free(&sensor->ctrls.handler);
-LABEL_CLEANUP:
+    gc2145_set_power_off(sensor);
     media_entity_cleanup(&sensor->sd.entity);
     mutex_destroy(&sensor->lock);
     return ret;
@@ -2200,7 +4608,13 @@ static int gc2145_remove(struct i2c_client *client)
 #ifdef GC2145_DEBUG_MSG
     printk("%s: called\n", __func__);
 #endif
+    debugfs_remove_recursive(sensor->debugfs);
     v4l2_async_unregister_subdev(&sensor->sd);
+    /* The VSYNC handler kicks the work */
+    if (sensor->vsync_irq > 0)
+        disable_irq(sensor->vsync_irq);
+    cancel_delayed_work_sync(&sensor->aaa_work);
+    gc2145_set_power_off(sensor);
     media_entity_cleanup(&sensor->sd.entity);
     v4l2_ctrl_handler_free(&sensor->ctrls.handler);
     mutex_destroy(&sensor->lock);